@@ -0,0 +1,97 @@
+/*
+ * File:   ChartArena.hpp
+ * Author: Johannes Gontrum
+ *
+ * Scratch memory for the charts and caches of one worker, reused for every sentence.
+ */
+
+#ifndef CHARTARENA_HPP
+#define	CHARTARENA_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+
+/*
+ * A bump allocator: The memory of a sentence (its chart, the scratch rows of the calculator or
+ * the values of a forest) is cut from one block in the order of the requests, and all of it is
+ * given back at once by reset(), which only sets the position back to the start. Nothing is
+ * freed until the arena is destroyed.
+ *
+ * When the block is too small, the missing memory is allocated in extra blocks. They are
+ * merged at the next reset() into one block for the largest sentence seen so far, so after the
+ * longest sentence has been processed once, no memory is allocated anymore.
+ *
+ * The memory is not initialised and only suitable for trivial types like double and unsigned.
+ * An arena belongs to one thread.
+ */
+class ChartArena {
+public:
+    ChartArena() : capacity(0), offset(0), used(0), peak(0), no_of_allocations(0) {
+    }
+
+    ChartArena(ChartArena&&) = default;
+    ChartArena& operator=(ChartArena&&) = default;
+    ChartArena(const ChartArena&) = delete;
+    ChartArena& operator=(const ChartArena&) = delete;
+
+    /// Memory for count values of a trivial type, valid until the next reset().
+    template <typename Value>
+    Value * allocate(std::size_t count) {
+        std::size_t bytes = (count * sizeof(Value) + alignment - 1) / alignment * alignment;
+        used += bytes;
+        peak = std::max(peak, used);
+        if (offset + bytes <= capacity) {
+            char * result = block.get() + offset;
+            offset += bytes;
+            return (Value*) result;
+        }
+        overflow.push_back(std::unique_ptr<char[]>(new char[bytes]));
+        ++no_of_allocations;
+        return (Value*) overflow.back().get();
+    }
+
+    /// Memory for count values, all set to value.
+    template <typename Value>
+    Value * allocate(std::size_t count, Value value) {
+        Value * result = allocate<Value>(count);
+        std::fill(result, result + count, value);
+        return result;
+    }
+
+    /// Gives back all memory at once. Only allocates, if the block was too small since the last reset.
+    void reset() {
+        if (!overflow.empty()) {
+            overflow.clear();
+            block.reset(new char[peak]);
+            capacity = peak;
+            ++no_of_allocations;
+        }
+        offset = 0;
+        used = 0;
+    }
+
+    /// The number of blocks that have been allocated so far.
+    std::size_t allocations() const {
+        return no_of_allocations;
+    }
+
+    /// The largest amount of memory that was used between two resets, in bytes.
+    std::size_t peak_bytes() const {
+        return peak;
+    }
+
+private:
+    static const std::size_t alignment = alignof(std::max_align_t);
+
+    std::unique_ptr<char[]>                 block;      ///< The memory that is reused
+    std::vector<std::unique_ptr<char[]> >   overflow;   ///< Extra blocks since the last reset
+    std::size_t                             capacity;   ///< Size of the block
+    std::size_t                             offset;     ///< Used part of the block
+    std::size_t                             used;       ///< Memory since the last reset, including the extra blocks
+    std::size_t                             peak;       ///< Largest value of used
+    std::size_t                             no_of_allocations; ///< Blocks allocated so far
+};
+
+#endif	/* CHARTARENA_HPP */
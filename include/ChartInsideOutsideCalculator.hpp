@@ -0,0 +1,538 @@
+/*
+ * File:   ChartInsideOutsideCalculator.hpp
+ * Author: Johannes Gontrum
+ *
+ * Bottom-up (CKY-style) alternative to the recursive InsideOutsideCalculator.
+ */
+
+#ifndef CHARTINSIDEOUTSIDECALCULATOR_HPP
+#define	CHARTINSIDEOUTSIDECALCULATOR_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+#include "PCFGRule.hpp"
+#include "CompiledGrammar.hpp"
+#include "InsideOutsideChart.hpp"
+#include "InsideOutsideKernel.hpp"
+#include "ExpectedCounts.hpp"
+#include "ThreadBarrier.hpp"
+#include "InsideSpanCache.hpp"
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cassert>
+
+#include "Tracing.hpp"
+
+/// Calculates the inside and outside values of a sentence by filling a dense chart.
+/// In contrast to the InsideOutsideCalculator, no recursion and no hashing is involved:
+/// The inside pass visits all spans by increasing length, the outside pass walks back
+/// from the whole sentence down to the single words. Each binary rule is applied once per
+/// span in each pass, the sum over the split points is done by the vectorised kernels of
+/// the InsideOutsideKernel. The whole chart is known after the construction.
+/// If an ExpectedCounts object is given, the expectations of the sentence are added to it
+/// during the outside pass, so the EMTrainer does not need to query the chart at all.
+/// All cells of the same span length are independent of each other, so a single chart can
+/// be filled by several threads, one diagonal after the other.
+class ChartInsideOutsideCalculator {
+public:
+    typedef InsideOutsideChart::InsideOutsideProbability        InsideOutsideProbability;
+    typedef ProbabilisticContextFreeGrammar::Symbol             Symbol;
+    typedef ProbabilisticContextFreeGrammar::NonterminalID      NonterminalID;
+
+    /// How the values are represented in the chart.
+    enum Arithmetic {
+        PLAIN,      ///< Plain doubles. Long sentences can underflow to 0.
+        SCALED      ///< Doubles with a power of two scaling factor per span. Does not underflow.
+    };
+
+private:
+    typedef std::vector<Symbol>                                 SymbolVector;
+    typedef CompiledGrammar::BinaryRule                         BinaryRule;
+    typedef CompiledGrammar::BinaryRuleRange                    BinaryRuleRange;
+    typedef CompiledGrammar::LexicalRule                        LexicalRule;
+    typedef CompiledGrammar::LexicalRuleRange                   LexicalRuleRange;
+
+    /// Scratch memory of one thread, taken from the arena. The chart itself is shared.
+    struct Workspace {
+        InsideOutsideProbability *  cell;           ///< Inside values of the current cell
+        InsideOutsideProbability *  scaled_left;    ///< Scaled copies of the first children per split point
+        InsideOutsideProbability *  scaled_right;   ///< Scaled copies of the second children per split point
+        InsideOutsideProbability *  split_weights;  ///< Correction factor per split point of the current span
+        ExpectedCounts *            expectations;   ///< Where the expectations of the sentence go, or nullptr
+        InsideOutsideProbability *  rule_counts;    ///< Private rule expectations, if there are several threads
+        InsideOutsideProbability *  symbol_counts;  ///< Private symbol expectations, if there are several threads
+
+        /// Adds the expectation to the private counts of the thread, if it has some, else to the given ones.
+        inline void add_rule(unsigned rule, InsideOutsideProbability value) {
+            if (rule_counts != nullptr) {
+                rule_counts[rule] += value;
+            } else {
+                expectations->add_rule(rule, value);
+            }
+        }
+
+        inline void add_symbol(unsigned nt, InsideOutsideProbability value) {
+            if (symbol_counts != nullptr) {
+                symbol_counts[nt] += value;
+            } else {
+                expectations->add_symbol(nt, value);
+            }
+        }
+    };
+
+    /// The split points k (begin <= k < end) of a rule application, for which the children have nonzero values.
+    struct SplitRange {
+        int first;
+        int last;
+
+        unsigned size() const {
+            return first <= last ? last - first + 1 : 0;
+        }
+    };
+
+public:
+    /// The chart and the scratch memory are taken from the given arena (or from an own one), so they
+    /// are only valid until the arena is reset.
+    ChartInsideOutsideCalculator(const CompiledGrammar& compiled, const SymbolVector * sentence,
+            ExpectedCounts * expectations = nullptr, const InsideOutsideKernel& simd = InsideOutsideKernel(),
+            Arithmetic mode = SCALED, unsigned threads = 1, InsideSpanCache * cache = nullptr, ChartArena * arena = nullptr)
+    :
+    grammar(compiled),
+    kernel(simd),
+    arithmetic(mode),
+    input(sentence),
+    sentence_len(sentence->size()),
+    chart(sentence->size(), compiled.no_of_nonterminals(), arena != nullptr ? *arena : own_arena),
+    workspaces(std::max(1u, std::min(threads, sentence_len))),
+    span_cache(cache) {
+        PCFGEM_VLOG(7) << "ChartInsideOutsideCalculator: The chart stores " << InsideOutsideChart::no_of_values(sentence_len, grammar.no_of_nonterminals()) << " values.";
+        if (span_cache != nullptr) {
+            InsideSpanCache::prefix_hashes(*input, prefix_hashes, hash_powers);
+        }
+        ChartArena& memory = arena != nullptr ? *arena : own_arena;
+        for (Workspace& workspace : workspaces) {
+            workspace.cell = memory.allocate<InsideOutsideProbability>(grammar.no_of_nonterminals());
+            if (arithmetic == SCALED) {
+                workspace.scaled_left = memory.allocate<InsideOutsideProbability>(grammar.no_of_nonterminals() * sentence_len);
+                workspace.scaled_right = memory.allocate<InsideOutsideProbability>(grammar.no_of_nonterminals() * sentence_len);
+                workspace.split_weights = memory.allocate<InsideOutsideProbability>(sentence_len);
+            }
+            workspace.expectations = expectations;
+            workspace.rule_counts = nullptr;
+            workspace.symbol_counts = nullptr;
+        }
+
+        fill_inside_chart();
+        // Without a parse, all outside values of the nonterminals below the root are 0 anyway.
+        if (sentence_len > 0 && grammar.get_start_id() >= 0 && chart.inside(grammar.get_start_id(), 0, sentence_len - 1) > 0) {
+            // With several threads, each one sums up its expectations privately. They are added to the
+            // given counts in the order of the threads, so the result is the same in every run.
+            bool private_counts = expectations != nullptr && workspaces.size() > 1;
+            if (private_counts) {
+                for (Workspace& workspace : workspaces) {
+                    workspace.rule_counts = memory.allocate<InsideOutsideProbability>(grammar.get_grammar().no_of_rules(), 0);
+                    workspace.symbol_counts = memory.allocate<InsideOutsideProbability>(grammar.no_of_nonterminals(), 0);
+                }
+            }
+            fill_outside_chart();
+            if (private_counts) {
+                for (const Workspace& workspace : workspaces) {
+                    expectations->add(workspace.rule_counts, workspace.symbol_counts);
+                }
+            }
+        }
+    }
+
+    /// Returns the inside probability, that the given symbol produces the words from begin to end.
+    /// Terminal symbols always have an inside probability of 0.
+    /// Note that the value can underflow to 0 for long spans, even if it is positive in the chart.
+    inline InsideOutsideProbability calculate_inside(const Symbol& symbol, unsigned begin, unsigned end) const {
+        assert(begin <= end);
+        assert(end < sentence_len);
+
+        NonterminalID nt = grammar.get_nonterminal_id(symbol);
+        return nt >= 0 ? std::ldexp(chart.inside(nt, begin, end), chart.exponent(begin, end)) : 0;
+    }
+
+    /// Returns the natural logarithm of the inside probability, or -infinity if it is 0.
+    /// In the scaled mode, this value is exact for spans of any length.
+    inline InsideOutsideProbability calculate_log_inside(const Symbol& symbol, unsigned begin, unsigned end) const {
+        assert(begin <= end);
+        assert(end < sentence_len);
+
+        NonterminalID nt = grammar.get_nonterminal_id(symbol);
+        InsideOutsideProbability value = nt >= 0 ? chart.inside(nt, begin, end) : 0;
+        if (value > 0) {
+            return std::log(value) + chart.exponent(begin, end) * std::log(2.0);
+        }
+        return -std::numeric_limits<InsideOutsideProbability>::infinity();
+    }
+
+    /// Returns the outside probability of the given symbol for the span from left to right.
+    inline InsideOutsideProbability calculate_outside(const Symbol& symbol, unsigned left, unsigned right) const {
+        assert(left <= right);
+        assert(right < sentence_len);
+
+        NonterminalID nt = grammar.get_nonterminal_id(symbol);
+        int exponent = chart.exponent(0, sentence_len - 1) - chart.exponent(left, right);
+        return nt >= 0 ? std::ldexp(chart.outside(nt, left, right), exponent) : 0;
+    }
+
+    const InsideOutsideChart& get_chart() const {
+        return chart;
+    }
+
+private:
+    void fill_inside_chart() {
+        PCFGEM_VLOG(7) << "ChartInsideOutsideCalculator: Filling the inside chart for a sentence of length " << sentence_len;
+
+        // Base case: spans of length one are covered by the preterminal rules.
+        InsideOutsideProbability * cell = workspaces[0].cell;
+        for (unsigned i = 0; i < sentence_len; ++i) {
+            std::fill(cell, cell + grammar.no_of_nonterminals(), 0);
+            LexicalRuleRange rules = grammar.rules_for_terminal((*input)[i]);
+            for (const LexicalRule * rule = rules.first; rule != rules.second; ++rule) {
+                cell[rule->lhs] += rule->prob;
+            }
+            store_inside_cell(cell, i, i, 0);
+        }
+
+        // Inductive case: combine two smaller spans, shortest spans first.
+        for_each_cell(false, [this](Workspace& workspace, unsigned begin, unsigned end) {
+            fill_inside_cell(workspace, begin, end);
+        });
+    }
+
+    void fill_inside_cell(Workspace& workspace, unsigned begin, unsigned end) {
+        InsideOutsideProbability * cell = workspace.cell;
+        NonterminalID no_of_nts = grammar.no_of_nonterminals();
+
+        // Another sentence with the same words in this span has already computed the cell.
+        bool cached = span_cache != nullptr && end - begin + 1 >= span_cache->get_min_length();
+        InsideSpanCache::Hash hash = 0;
+        if (cached) {
+            hash = InsideSpanCache::span_hash(prefix_hashes, hash_powers, begin, end + 1);
+            int exponent = 0;
+            if (span_cache->lookup(hash, &(*input)[begin], end - begin + 1, cell, no_of_nts, exponent)) {
+                if (arithmetic == SCALED) {
+                    chart.set_exponent(begin, end, exponent);
+                }
+                for (NonterminalID nt = 0; nt < no_of_nts; ++nt) {
+                    chart.set_inside(nt, begin, end, cell[nt]);
+                }
+                return;
+            }
+        }
+
+        std::fill(cell, cell + no_of_nts, 0);
+
+        // The values of the cell are relative to the largest scaling factor of the split points.
+        int reference = 0;
+        if (arithmetic == SCALED) {
+            reference = max_split_exponent(begin, end);
+            scale_children(workspace, begin, end, reference, false);
+        }
+
+        // Iterate over all binary rules, grouped by their first child, so first children
+        // without an inside value in the row of this span can be skipped with all their rules.
+        for (NonterminalID left = 0; left < no_of_nts; ++left) {
+            SplitRange left_range = left_splits(left, begin, end);
+            if (left_range.size() == 0) {
+                continue;
+            }
+            BinaryRuleRange rules = grammar.rules_for_left(left);
+            for (const BinaryRule * rule = rules.first; rule != rules.second; ++rule) {
+                // Only the split points where both children have a value have to be summed up.
+                SplitRange splits = right_splits(*rule, begin, end);
+                splits.first = std::max(splits.first, left_range.first);
+                splits.last = std::min(splits.last, left_range.last);
+                if (splits.size() > 0) {
+                    cell[rule->lhs] += rule->prob * kernel.dot(
+                            chart.inside_row_by_begin(left, begin, splits.first),
+                            right_child_values(workspace, rule->right, end, splits.first),
+                            splits.size());
+                }
+            }
+        }
+        store_inside_cell(cell, begin, end, reference);
+        if (cached) {
+            span_cache->insert(hash, &(*input)[begin], end - begin + 1, cell, no_of_nts, arithmetic == SCALED ? chart.exponent(begin, end) : 0);
+        }
+    }
+
+    /*
+     * Calls function(workspace, begin, end) for all spans with a length of at least 2, either bottom-up
+     * (increasing length) or top-down. With several threads, the cells of one span length are split
+     * into equal parts, one per thread, and all threads wait for each other before the next span
+     * length starts. Cells of the same length never write to the same part of the chart: The
+     * inside values and the outside mass for first children go to the rows of their begin
+     * position, the outside mass for second children to the rows of their end position.
+     */
+    template <typename Function>
+    void for_each_cell(bool top_down, Function function) {
+        if (workspaces.size() == 1) {
+            for (unsigned step = 0; step + 1 < sentence_len; ++step) {
+                unsigned span = top_down ? sentence_len - step : step + 2;
+                for (unsigned begin = 0; begin + span <= sentence_len; ++begin) {
+                    function(workspaces[0], begin, begin + span - 1);
+                }
+            }
+            return;
+        }
+
+        unsigned no_of_threads = workspaces.size();
+        ThreadBarrier barrier(no_of_threads);
+        auto work = [this, top_down, &function, &barrier, no_of_threads](unsigned thread) {
+            for (unsigned step = 0; step + 1 < sentence_len; ++step) {
+                unsigned span = top_down ? sentence_len - step : step + 2;
+                unsigned no_of_cells = sentence_len - span + 1;
+                for (unsigned begin = no_of_cells * thread / no_of_threads; begin < no_of_cells * (thread + 1) / no_of_threads; ++begin) {
+                    function(workspaces[thread], begin, begin + span - 1);
+                }
+                barrier.wait();
+            }
+        };
+
+        std::vector<std::thread> helpers;
+        for (unsigned thread = 1; thread < no_of_threads; ++thread) {
+            helpers.push_back(std::thread(work, thread));
+        }
+        work(0);
+        for (std::thread& helper : helpers) {
+            helper.join();
+        }
+    }
+
+    /*
+     * The outside values are computed top-down: The start symbol has an outside value of 1
+     * for the whole sentence. Every cell then passes its outside mass on to the children of
+     * each binary rule, before any of the (shorter) child spans is visited itself.
+     * See 'Foundations of Statistical Natural Language Processing' by Manning & Schuetze, pp.400.
+     *
+     * Since the outside value of a cell is complete when it is visited, the expectations
+     * (11.24), (11.26) and (11.27) can be collected in the same sweep. Only rule applications
+     * with a nonzero score are added.
+     *
+     * In the scaled mode, the outside values of a span are stored multiplied by the scaling
+     * factor of its inside values and divided by the one of the whole sentence. Inside times
+     * outside divided by pi then needs no correction, and the outside mass that is passed
+     * from a parent to a child only has to be corrected by the same factor per split point
+     * as in the inside pass.
+     */
+    void fill_outside_chart() {
+        PCFGEM_VLOG(7) << "ChartInsideOutsideCalculator: Filling the outside chart for a sentence of length " << sentence_len;
+
+        NonterminalID start = grammar.get_start_id();
+        InsideOutsideProbability inverted_pi = 1 / chart.inside(start, 0, sentence_len - 1);
+        chart.set_outside(start, 0, sentence_len - 1, 1);
+
+        for_each_cell(true, [this, inverted_pi](Workspace& workspace, unsigned begin, unsigned end) {
+            fill_outside_cell(workspace, begin, end, inverted_pi);
+        });
+
+        // The single words: preterminal rules and the nonterminals above them.
+        Workspace& workspace = workspaces[0];
+        if (workspace.expectations != nullptr) {
+            for (unsigned i = 0; i < sentence_len; ++i) {
+                add_symbol_expectations(i, i, inverted_pi, workspace);
+
+                LexicalRuleRange rules = grammar.rules_for_terminal((*input)[i]);
+                for (const LexicalRule * rule = rules.first; rule != rules.second; ++rule) {
+                    InsideOutsideProbability score = chart.outside(rule->lhs, i, i) * std::ldexp(rule->prob, -chart.exponent(i, i));
+                    if (score != 0) {
+                        workspace.add_rule(rule->id, score * inverted_pi);
+                    }
+                }
+            }
+        }
+    }
+
+    void fill_outside_cell(Workspace& workspace, unsigned begin, unsigned end, InsideOutsideProbability inverted_pi) {
+        if (workspace.expectations != nullptr) {
+            add_symbol_expectations(begin, end, inverted_pi, workspace);
+        }
+        if (arithmetic == SCALED) {
+            scale_children(workspace, begin, end, chart.exponent(begin, end), true);
+        }
+
+        // Iterate over all binary rules, grouped by their parent, so
+        // parents without an outside value can be skipped with all their rules.
+        for (NonterminalID lhs = 0; lhs < (NonterminalID) grammar.no_of_nonterminals(); ++lhs) {
+            InsideOutsideProbability lhs_score = chart.outside(lhs, begin, end);
+            if (lhs_score != 0) {
+                BinaryRuleRange rules = grammar.rules_for_lhs(lhs);
+                for (const BinaryRule * rule = rules.first; rule != rules.second; ++rule) {
+                    apply_outside(workspace, *rule, begin, end, lhs_score * rule->prob, inverted_pi);
+                }
+            }
+        }
+    }
+
+    /// Pushes the outside mass (outside value of the parent * rule probability) of one rule
+    /// application for the span [begin, end] to both children and adds the rule expectation.
+    inline void apply_outside(Workspace& workspace, const BinaryRule& rule, unsigned begin, unsigned end, InsideOutsideProbability parent,
+            InsideOutsideProbability inverted_pi) {
+        // The outside value of one child is the outside value of the parent times
+        // the inside value of its sibling. So the first child gets mass for every split point
+        // where the second child has an inside value, and vice versa.
+        SplitRange splits = right_splits(rule, begin, end);
+        if (splits.size() > 0) {
+            kernel.axpy(parent, right_child_values(workspace, rule.right, end, splits.first),
+                    chart.outside_row_by_begin(rule.left, begin, splits.first), splits.size());
+        }
+        splits = left_splits(rule, begin, end);
+        if (splits.size() > 0) {
+            kernel.axpy(parent, left_child_values(workspace, rule.left, begin, splits.first),
+                    chart.outside_row_by_end(rule.right, end, splits.first + 1), splits.size());
+        }
+
+        if (workspace.expectations != nullptr) {
+            splits = child_splits(rule, begin, end);
+            if (splits.size() > 0) {
+                InsideOutsideProbability score = parent * kernel.dot(chart.inside_row_by_begin(rule.left, begin, splits.first),
+                        right_child_values(workspace, rule.right, end, splits.first), splits.size());
+                if (score != 0) {
+                    workspace.add_rule(rule.id, score * inverted_pi);
+                }
+            }
+        }
+    }
+
+    /// Split points, where the first child of the rule has a nonzero inside value.
+    inline SplitRange left_splits(const BinaryRule& rule, unsigned begin, unsigned end) const {
+        return left_splits(rule.left, begin, end);
+    }
+
+    inline SplitRange left_splits(const NonterminalID& left, unsigned begin, unsigned end) const {
+        SplitRange range;
+        range.first = std::max(begin, chart.first_nonzero_end(left, begin));
+        range.last = std::min(end - 1, chart.last_nonzero_end(left, begin));
+        return range;
+    }
+
+    /// Split points, where the second child of the rule has a nonzero inside value.
+    inline SplitRange right_splits(const BinaryRule& rule, unsigned begin, unsigned end) const {
+        return right_splits(rule.right, begin, end);
+    }
+
+    inline SplitRange right_splits(const NonterminalID& right, unsigned begin, unsigned end) const {
+        SplitRange range;
+        range.first = std::max((int) begin, (int) chart.first_nonzero_begin(right, end) - 1);
+        range.last = std::min((int) end - 1, (int) chart.last_nonzero_begin(right, end) - 1);
+        return range;
+    }
+
+    /// Split points, where both children of the rule have a nonzero inside value.
+    inline SplitRange child_splits(const BinaryRule& rule, unsigned begin, unsigned end) const {
+        SplitRange left = left_splits(rule, begin, end);
+        SplitRange right = right_splits(rule, begin, end);
+        left.first = std::max(left.first, right.first);
+        left.last = std::min(left.last, right.last);
+        return left;
+    }
+
+    /// Inside values of the first child (begin, k), (begin, k+1), ... for the split points k, k+1, ...
+    /// In the scaled mode, they are corrected by the factor of each split point (see scale_children()).
+    inline const InsideOutsideProbability* left_child_values(const Workspace& workspace, const NonterminalID& nt, unsigned begin, unsigned k) const {
+        return arithmetic == SCALED ? &workspace.scaled_left[nt * sentence_len + k] : chart.inside_row_by_begin(nt, begin, k);
+    }
+
+    /// Inside values of the second child (k+1, end), (k+2, end), ... for the split points k, k+1, ...
+    inline const InsideOutsideProbability* right_child_values(const Workspace& workspace, const NonterminalID& nt, unsigned end, unsigned k) const {
+        return arithmetic == SCALED ? &workspace.scaled_right[nt * sentence_len + k] : chart.inside_row_by_end(nt, end, k + 1);
+    }
+
+    /// The largest sum of the exponents of both children over all split points of the span.
+    int max_split_exponent(unsigned begin, unsigned end) const {
+        int result = std::numeric_limits<int>::min();
+        for (unsigned k = begin; k < end; ++k) {
+            result = std::max(result, chart.exponent(begin, k) + chart.exponent(k + 1, end));
+        }
+        return result;
+    }
+
+    /*
+     * The product of the stored values of both children at a split point k is the true
+     * product divided by 2^(exponent(begin, k) + exponent(k + 1, end)). This exponent differs
+     * between the split points, so the stored values cannot be summed up directly.
+     * Instead, the weight 2^(exponent(begin, k) + exponent(k + 1, end) - reference) is multiplied
+     * into a copy of the second (and if needed, the first) child values once per span.
+     * All rules of the span can then use the kernels on the copies as usual.
+     */
+    void scale_children(Workspace& workspace, unsigned begin, unsigned end, int reference, bool scale_left) {
+        InsideOutsideProbability * split_weights = workspace.split_weights;
+        for (unsigned k = begin; k < end; ++k) {
+            split_weights[k] = std::ldexp(1.0, chart.exponent(begin, k) + chart.exponent(k + 1, end) - reference);
+        }
+
+        for (NonterminalID nt = 0; nt < (NonterminalID) grammar.no_of_nonterminals(); ++nt) {
+            SplitRange splits = right_splits(nt, begin, end);
+            InsideOutsideProbability * target = &workspace.scaled_right[nt * sentence_len];
+            for (int k = splits.first; k <= splits.last; ++k) {
+                target[k] = chart.inside(nt, k + 1, end) * split_weights[k];
+            }
+            if (scale_left) {
+                splits = left_splits(nt, begin, end);
+                target = &workspace.scaled_left[nt * sentence_len];
+                for (int k = splits.first; k <= splits.last; ++k) {
+                    target[k] = chart.inside(nt, begin, k) * split_weights[k];
+                }
+            }
+        }
+    }
+
+    /// Writes the inside values of all nonterminals for the span [begin, end] into the chart.
+    /// In the scaled mode, the values are normalised so that the largest one is in [0.5, 1) and the
+    /// exponent of the cell becomes reference + shift. The weights of the outside pass (see scale_children())
+    /// exceed 1, if shift < 0, but each product of a weight, the stored values of both children and a rule
+    /// probability is a summand of a stored value of this cell. So it is below 1, and the outside mass that
+    /// is passed on to the children stays finite. A cell without any value keeps the reference exponent.
+    void store_inside_cell(InsideOutsideProbability * cell, unsigned begin, unsigned end, int reference) {
+        NonterminalID no_of_nts = grammar.no_of_nonterminals();
+        if (arithmetic == SCALED) {
+            InsideOutsideProbability max = *std::max_element(cell, cell + no_of_nts);
+            int shift = 0;
+            if (max > 0) {
+                std::frexp(max, &shift);
+                for (NonterminalID nt = 0; nt < no_of_nts; ++nt) {
+                    cell[nt] = std::ldexp(cell[nt], -shift);
+                }
+            }
+            chart.set_exponent(begin, end, reference + shift);
+        }
+        for (NonterminalID nt = 0; nt < no_of_nts; ++nt) {
+            chart.set_inside(nt, begin, end, cell[nt]);
+        }
+    }
+
+    /// Adds inside * outside / pi of all nonterminals in the cell [begin, end] to the symbol expectations.
+    void add_symbol_expectations(unsigned begin, unsigned end, InsideOutsideProbability inverted_pi, Workspace& workspace) const {
+        for (NonterminalID nt = 0; nt < (NonterminalID) chart.get_no_of_nonterminals(); ++nt) {
+            InsideOutsideProbability score = chart.inside(nt, begin, end);
+            if (score != 0) {
+                score *= chart.outside(nt, begin, end);
+                if (score != 0) {
+                    workspace.add_symbol(nt, score * inverted_pi);
+                }
+            }
+        }
+    }
+
+private:
+    const CompiledGrammar&                  grammar;        ///< Compiled view of the grammar to lookup the rules
+    InsideOutsideKernel                     kernel;         ///< Vectorised loops over the split points
+    Arithmetic                              arithmetic;     ///< Plain or scaled values
+    const SymbolVector *                    input;          ///< The current sentence
+    unsigned                                sentence_len;   ///< The length of the current sentence
+    ChartArena                              own_arena;      ///< The memory, if no arena is given
+    InsideOutsideChart                      chart;          ///< Dense chart with all inside and outside values
+    std::vector<Workspace>                  workspaces;     ///< Scratch memory per thread
+    InsideSpanCache *                       span_cache;     ///< Inside values shared with other sentences, or nullptr
+    std::vector<InsideSpanCache::Hash>      prefix_hashes;  ///< Hashes of all prefixes of the sentence for the span cache
+    std::vector<InsideSpanCache::Hash>      hash_powers;    ///< Powers of the hash base
+};
+
+#endif	/* CHARTINSIDEOUTSIDECALCULATOR_HPP */
@@ -0,0 +1,218 @@
+/*
+ * File:   CompiledGrammar.hpp
+ * Author: Johannes Gontrum
+ *
+ * A frozen, array based view of a ProbabilisticContextFreeGrammar for the chart calculator.
+ */
+
+#ifndef COMPILEDGRAMMAR_HPP
+#define	COMPILEDGRAMMAR_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+#include "PCFGRule.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "Tracing.hpp"
+
+/*
+ * Stores the binary rules of a grammar as contiguous records, so the inside and outside passes
+ * can stream over them without hashing or following pointers into the rule vector.
+ * The records are sorted twice: by their lhs for the outside pass, which skips parents without
+ * an outside value, and by their first child for the inside pass, which skips first children
+ * without an inside value. For both orderings, an offset array that is indexed by the dense
+ * nonterminal ID points to the beginning of the rules of each nonterminal (compressed sparse rows).
+ * In the same way, the preterminal rules are stored in a lexicon that is indexed by the
+ * ID of the terminal, so each cell on the diagonal of a chart is filled with one lookup.
+ *
+ * The view is a snapshot: It has to be rebuilt whenever the probabilities or the rules
+ * of the underlying grammar change.
+ */
+class CompiledGrammar {
+public:
+    typedef ProbabilisticContextFreeGrammar::Symbol         Symbol;
+    typedef ProbabilisticContextFreeGrammar::NonterminalID  NonterminalID;
+    typedef ProbabilisticContextFreeGrammar::RuleID         RuleID;
+    typedef ProbabilisticContextFreeGrammar::Probability    Probability;
+
+    /// A binary rule lhs -> left right, all symbols are dense nonterminal IDs.
+    struct BinaryRule {
+        NonterminalID   lhs;
+        NonterminalID   left;
+        NonterminalID   right;
+        RuleID          id;     ///< ID of the rule in the grammar
+        Probability     prob;
+    };
+
+    /// A preterminal rule lhs -> terminal, the lhs is a dense nonterminal ID.
+    struct LexicalRule {
+        NonterminalID   lhs;
+        RuleID          id;     ///< ID of the rule in the grammar
+        Probability     prob;
+    };
+
+    typedef std::vector<BinaryRule>                         BinaryRuleVector;
+    typedef std::pair<const BinaryRule*, const BinaryRule*> BinaryRuleRange;
+    typedef std::vector<LexicalRule>                        LexicalRuleVector;
+    typedef std::pair<const LexicalRule*, const LexicalRule*> LexicalRuleRange;
+
+private:
+    typedef std::vector<unsigned>                           OffsetVector;
+    typedef ProbabilisticContextFreeGrammar::const_iterator PCFGCIt;
+
+public:
+    explicit CompiledGrammar(const ProbabilisticContextFreeGrammar& pcfg)
+    :
+    grammar(pcfg),
+    no_of_nts(pcfg.no_of_nonterminals()),
+    start_id(pcfg.get_nonterminal_id(pcfg.get_start_symbol())) {
+        build_binary_rules();
+        build_lexicon();
+    }
+
+    const ProbabilisticContextFreeGrammar& get_grammar() const {
+        return grammar;
+    }
+
+    unsigned no_of_nonterminals() const {
+        return no_of_nts;
+    }
+
+    /// The dense ID of the start symbol or -1, if there are no rules for it.
+    const NonterminalID& get_start_id() const {
+        return start_id;
+    }
+
+    inline NonterminalID get_nonterminal_id(const Symbol& sym) const {
+        return grammar.get_nonterminal_id(sym);
+    }
+
+    /// All binary rules, sorted by their lhs.
+    const BinaryRuleVector& get_binary_rules() const {
+        return by_lhs;
+    }
+
+    /// Returns all binary rules with the given nonterminal as lhs.
+    inline BinaryRuleRange rules_for_lhs(const NonterminalID& nt) const {
+        return range(by_lhs, lhs_offsets, nt);
+    }
+
+    /// Returns all binary rules with the given nonterminal as the first symbol on the rhs.
+    inline BinaryRuleRange rules_for_left(const NonterminalID& nt) const {
+        return range(by_left, left_offsets, nt);
+    }
+
+    /// Returns all preterminal rules, that produce the given terminal.
+    inline LexicalRuleRange rules_for_terminal(const Symbol& terminal) const {
+        if (terminal < 0 || (unsigned) terminal + 1 >= lexicon_offsets.size()) {
+            return LexicalRuleRange(nullptr, nullptr);
+        }
+        const LexicalRule * data = lexicon.data();
+        return LexicalRuleRange(data + lexicon_offsets[terminal], data + lexicon_offsets[terminal + 1]);
+    }
+
+private:
+    void build_binary_rules() {
+        for (PCFGCIt rule = grammar.begin(); rule != grammar.end(); ++rule) {
+            if (rule->arity() == 2) {
+                BinaryRule record;
+                record.lhs = grammar.get_nonterminal_id(rule->get_lhs());
+                record.left = grammar.get_nonterminal_id((*rule)[0]);
+                record.right = grammar.get_nonterminal_id((*rule)[1]);
+                record.id = grammar.get_rule_id(*rule);
+                record.prob = rule->get_prob();
+                // Rules with terminals on the rhs can never be applied in a chart.
+                if (record.left >= 0 && record.right >= 0) {
+                    by_lhs.push_back(record);
+                }
+            }
+        }
+        by_left = by_lhs;
+
+        sort_and_index(by_lhs, lhs_offsets, &BinaryRule::lhs);
+        sort_and_index(by_left, left_offsets, &BinaryRule::left);
+
+        PCFGEM_VLOG(5) << "CompiledGrammar: " << by_lhs.size() << " binary rules for " << no_of_nts << " nonterminals compiled.";
+    }
+
+    /// Groups the preterminal rules by their terminal, using the same offset scheme as for the binary rules.
+    void build_lexicon() {
+        Symbol max_terminal = -1;
+        for (PCFGCIt rule = grammar.begin(); rule != grammar.end(); ++rule) {
+            if (rule->arity() == 1) {
+                max_terminal = std::max(max_terminal, (*rule)[0]);
+            }
+        }
+
+        // Count the rules per terminal first, then place them at their positions.
+        lexicon_offsets.assign(max_terminal + 2, 0);
+        for (PCFGCIt rule = grammar.begin(); rule != grammar.end(); ++rule) {
+            if (rule->arity() == 1) {
+                ++lexicon_offsets[(*rule)[0] + 1];
+            }
+        }
+        for (Symbol t = 0; t <= max_terminal; ++t) {
+            lexicon_offsets[t + 1] += lexicon_offsets[t];
+        }
+
+        OffsetVector next(lexicon_offsets.begin(), lexicon_offsets.end() - 1);
+        lexicon.resize(lexicon_offsets.back());
+        for (PCFGCIt rule = grammar.begin(); rule != grammar.end(); ++rule) {
+            if (rule->arity() == 1) {
+                LexicalRule& record = lexicon[next[(*rule)[0]]++];
+                record.lhs = grammar.get_nonterminal_id(rule->get_lhs());
+                record.id = grammar.get_rule_id(*rule);
+                record.prob = rule->get_prob();
+            }
+        }
+
+        PCFGEM_VLOG(5) << "CompiledGrammar: " << lexicon.size() << " preterminal rules compiled.";
+    }
+
+    /// Sorts the rules by the given member (ties are broken by the rule ID) and fills the offset array.
+    void sort_and_index(BinaryRuleVector& rules, OffsetVector& offsets, NonterminalID BinaryRule::* key) {
+        std::sort(rules.begin(), rules.end(), KeyComparator(key));
+
+        // offsets[nt] is the position of the first rule for nt, offsets[nt + 1] the end of its rules.
+        offsets.assign(no_of_nts + 1, 0);
+        for (const BinaryRule& rule : rules) {
+            ++offsets[rule.*key + 1];
+        }
+        for (unsigned nt = 0; nt < no_of_nts; ++nt) {
+            offsets[nt + 1] += offsets[nt];
+        }
+    }
+
+    inline BinaryRuleRange range(const BinaryRuleVector& rules, const OffsetVector& offsets, const NonterminalID& nt) const {
+        const BinaryRule * data = rules.data();
+        return BinaryRuleRange(data + offsets[nt], data + offsets[nt + 1]);
+    }
+
+    struct KeyComparator {
+        KeyComparator(NonterminalID BinaryRule::* k) : key(k) {
+        }
+
+        inline bool operator()(const BinaryRule& left, const BinaryRule& right) const {
+            return left.*key < right.*key || (left.*key == right.*key && left.id < right.id);
+        }
+
+        NonterminalID BinaryRule::* key;
+    };
+
+private:
+    const ProbabilisticContextFreeGrammar&  grammar;        ///< The grammar this view was compiled from
+    unsigned                                no_of_nts;      ///< Number of nonterminals
+    NonterminalID                           start_id;       ///< Dense ID of the start symbol
+
+    BinaryRuleVector                        by_lhs;         ///< Binary rules, sorted by lhs
+    BinaryRuleVector                        by_left;        ///< Binary rules, sorted by the first child
+    OffsetVector                            lhs_offsets;    ///< Offsets into by_lhs per nonterminal
+    OffsetVector                            left_offsets;   ///< Offsets into by_left per nonterminal
+
+    LexicalRuleVector                       lexicon;        ///< Preterminal rules, grouped by their terminal
+    OffsetVector                            lexicon_offsets;///< Offsets into lexicon per terminal
+};
+
+#endif	/* COMPILEDGRAMMAR_HPP */
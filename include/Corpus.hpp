@@ -0,0 +1,189 @@
+/*
+ * File:   Corpus.hpp
+ * Author: Johannes Gontrum
+ *
+ * The distinct sentences of a training corpus in one flat buffer of symbols.
+ */
+
+#ifndef CORPUS_HPP
+#define	CORPUS_HPP
+
+#include <vector>
+#include <unordered_set>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+
+#include <boost/functional/hash.hpp>
+
+#include "PCFGRule.hpp"
+
+/*
+ * Stores the symbols of all sentences one after another in a single vector, sentence s is
+ * [offsets[s], offsets[s + 1]) of the buffer. So a corpus of millions of sentences consists of
+ * a handful of large arrays instead of one small vector per sentence.
+ *
+ * Identical sentences are stored once, together with the number of times they occur. To find
+ * them, a hash set contains the indices of the sentences, its hasher and comparison read the
+ * words from the buffer. A new sentence is appended to the buffer first and removed again, if
+ * the set already contains an equal one, so the words are never copied into a key.
+ *
+ * Sentences that are known to be distinct, like the ones of an EncodedCorpus, can be appended
+ * without the lookup. They are only put into the set, if add() is called later.
+ */
+class Corpus {
+public:
+    typedef PCFGRule::ID            Symbol;
+    typedef std::vector<Symbol>     SymbolVector;
+
+public:
+    Corpus()
+    :
+    offsets(1, 0),
+    no_of_sentences(0),
+    no_of_indexed(0),
+    sentence_ids(0, SentenceHasher{this}, SentenceComparator{this}) {
+    }
+
+    /// The hash set refers to this object, so a corpus is neither copied nor moved.
+    Corpus(const Corpus&) = delete;
+    Corpus& operator=(const Corpus&) = delete;
+
+    /// Prepares the buffers for the given number of distinct sentences and symbols.
+    void reserve(std::size_t no_of_distinct, std::size_t no_of_symbols) {
+        offsets.reserve(no_of_distinct + 1);
+        counts.reserve(no_of_distinct);
+        symbols.reserve(no_of_symbols);
+        sentence_ids.reserve(no_of_distinct);
+    }
+
+    /// Adds a sentence that occurs count times. Returns the index of the sentence, which is the
+    /// index of an equal sentence that has been added before, if there is one.
+    unsigned add(const Symbol * words, unsigned length, unsigned count = 1) {
+        index_appended();
+        no_of_sentences += count;
+        unsigned candidate = counts.size();
+        symbols.insert(symbols.end(), words, words + length);
+        offsets.push_back(symbols.size());
+        counts.push_back(count);
+        std::pair<SentenceSet::iterator, bool> entry = sentence_ids.insert(candidate);
+        if (!entry.second) {
+            symbols.resize(offsets[candidate]);
+            offsets.pop_back();
+            counts.pop_back();
+            counts[*entry.first] += count;
+            return *entry.first;
+        }
+        no_of_indexed = counts.size();
+        return candidate;
+    }
+
+    /// Adds a sentence that differs from all sentences of the corpus, without comparing it with
+    /// them. Returns the index of the sentence.
+    unsigned append(const Symbol * words, unsigned length, unsigned count = 1) {
+        no_of_sentences += count;
+        symbols.insert(symbols.end(), words, words + length);
+        offsets.push_back(symbols.size());
+        counts.push_back(count);
+        return counts.size() - 1;
+    }
+
+    unsigned add(const SymbolVector& words, unsigned count = 1) {
+        return add(words.data(), words.size(), count);
+    }
+
+    /// Removes all sentences, but keeps the memory.
+    void clear() {
+        sentence_ids.clear();
+        symbols.clear();
+        offsets.assign(1, 0);
+        counts.clear();
+        no_of_sentences = 0;
+        no_of_indexed = 0;
+    }
+
+    /// The number of distinct sentences, which is also the upper bound of their indices.
+    unsigned size() const {
+        return counts.size();
+    }
+
+    bool empty() const {
+        return counts.empty();
+    }
+
+    /// The number of sentences including the repetitions.
+    std::size_t total() const {
+        return no_of_sentences;
+    }
+
+    /// The number of symbols of all distinct sentences.
+    std::size_t no_of_symbols() const {
+        return symbols.size();
+    }
+
+    /// The words of a sentence, followed by the words of the next one.
+    inline const Symbol * words(unsigned sentence) const {
+        assert(sentence < size());
+        return symbols.data() + offsets[sentence];
+    }
+
+    inline unsigned length(unsigned sentence) const {
+        assert(sentence < size());
+        return offsets[sentence + 1] - offsets[sentence];
+    }
+
+    /// How many times the sentence occurs in the corpus.
+    inline unsigned count(unsigned sentence) const {
+        assert(sentence < size());
+        return counts[sentence];
+    }
+
+    /// Copies the words of a sentence into a vector, e.g. for a calculator. The memory of the vector is reused.
+    void copy_sentence(unsigned sentence, SymbolVector& result) const {
+        result.assign(words(sentence), words(sentence) + length(sentence));
+    }
+
+    std::size_t memory_usage() const {
+        return symbols.capacity() * sizeof(Symbol) + offsets.capacity() * sizeof(std::uint64_t) + counts.capacity() * sizeof(unsigned)
+                + sentence_ids.bucket_count() * sizeof(void*) + sentence_ids.size() * (sizeof(unsigned) + 2 * sizeof(void*));
+    }
+
+private:
+    /// Puts the appended sentences into the set, before a new sentence is compared with them.
+    void index_appended() {
+        for (; no_of_indexed < counts.size(); ++no_of_indexed) {
+            sentence_ids.insert(no_of_indexed);
+        }
+    }
+
+    struct SentenceHasher {
+        const Corpus * corpus;
+
+        std::size_t operator()(unsigned sentence) const {
+            const Symbol * words = corpus->words(sentence);
+            return boost::hash_range(words, words + corpus->length(sentence));
+        }
+    };
+
+    struct SentenceComparator {
+        const Corpus * corpus;
+
+        bool operator()(unsigned left, unsigned right) const {
+            unsigned length = corpus->length(left);
+            return length == corpus->length(right) && std::equal(corpus->words(left), corpus->words(left) + length, corpus->words(right));
+        }
+    };
+
+    typedef std::unordered_set<unsigned, SentenceHasher, SentenceComparator> SentenceSet;
+
+private:
+    SymbolVector                symbols;            ///< The words of all distinct sentences
+    std::vector<std::uint64_t>  offsets;            ///< Sentence -> position of its first word, one more for the end
+    std::vector<unsigned>       counts;             ///< Sentence -> number of occurrences
+    std::size_t                 no_of_sentences;    ///< All sentences, including the repetitions
+    unsigned                    no_of_indexed;      ///< The sentences before this one are in the set
+    SentenceSet                 sentence_ids;       ///< The indices of the distinct sentences, compared by their words
+};
+
+#endif	/* CORPUS_HPP */
@@ -0,0 +1,182 @@
+/*
+ * File:   CorpusStream.hpp
+ * Author: Johannes Gontrum
+ *
+ * Reads a training corpus from its file in blocks of bounded size, again for every iteration.
+ */
+
+#ifndef CORPUSSTREAM_HPP
+#define	CORPUSSTREAM_HPP
+
+#include <string>
+#include <fstream>
+#include <memory>
+#include <limits>
+
+#include <boost/tokenizer.hpp>
+
+#include "Corpus.hpp"
+#include "EncodedCorpus.hpp"
+#include "GzipInputStream.hpp"
+#include "Signature.hpp"
+#include "Tracing.hpp"
+
+/*
+ * Instead of keeping all sentences for the whole training, the EMTrainer can read the corpus
+ * from the disk in every iteration, one block at a time. A block is a Corpus that is filled
+ * until it uses about the given number of bytes, so the memory does not depend on the size of
+ * the corpus. Identical sentences are only merged within a block.
+ *
+ * The file can be a text corpus or an EncodedCorpus. A text corpus is tokenized like in
+ * EMTrainer::read_in. It may be gzipped, then it is decompressed again in every pass. Of an
+ * encoded corpus, the words are only looked up once, and the pages of the blocks that have
+ * been read are given back, so the mapping does not grow the memory either.
+ *
+ * Unknown words are only reported in the first pass over the corpus.
+ */
+class CorpusStream {
+public:
+    typedef Corpus::Symbol              Symbol;
+    typedef Signature<std::string>      ExtSignature;
+
+public:
+    /// Opens the corpus for the symbols of the signature. Check is_open() afterwards.
+    CorpusStream(const std::string& file_path, const ExtSignature& sig, std::size_t block_bytes)
+    :
+    path(file_path),
+    signature(sig),
+    max_block_bytes(block_bytes),
+    first_pass(true),
+    failed(false),
+    line_no(1),
+    lines(0),
+    next_sentence(0) {
+        if (EncodedCorpus::is_encoded(path)) {
+            encoded.reset(new EncodedCorpus(path));
+            if (encoded->is_open()) {
+                translation = encoded->translate(signature);
+                lines = encoded->no_of_lines();
+            }
+        } else {
+            text = GzipInputStream::open(path);
+            if (!*text) {
+                LOG(ERROR) << "CorpusStream: Cannot open the corpus '" << path << "'.";
+            }
+        }
+    }
+
+    CorpusStream(const CorpusStream&) = delete;
+    CorpusStream& operator=(const CorpusStream&) = delete;
+
+    bool is_open() const {
+        return encoded ? encoded->is_open() : bool(*text);
+    }
+
+    /// True, if a pass over the text corpus ended at an error, e.g. in a corrupt gzip file. Check this after the training.
+    bool has_failed() const {
+        return failed;
+    }
+
+    /// Starts the next pass over the corpus.
+    void rewind() {
+        if (encoded) {
+            encoded->release(next_sentence);
+            next_sentence = 0;
+        } else if (GzipInputStream::is_gzip(path)) {
+            text = GzipInputStream::open(path);
+        } else {
+            text->clear();
+            text->seekg(0);
+        }
+        if (line_no > 1) {
+            first_pass = false;
+        }
+        line_no = 1;
+    }
+
+    /// Replaces the sentences of the block with the next ones of the corpus. Returns false, if
+    /// the end of the corpus has been reached before any sentence could be read.
+    bool read_block(Corpus& block) {
+        block.clear();
+        std::size_t max_symbols = std::max<std::size_t>(1, max_block_bytes / bytes_per_symbol);
+        if (encoded) {
+            std::uint64_t ignored = 0;
+            std::uint64_t first = next_sentence;
+            next_sentence = encoded->read(translation, block, next_sentence, max_symbols, ignored);
+            encoded->release(first);
+            line_no += next_sentence - first;
+        } else {
+            unsigned read = read_lines(*text, signature, block, max_symbols, line_no, first_pass);
+            failed = failed || text->bad();
+            if (first_pass) {
+                lines += read;
+            }
+        }
+        return !block.empty();
+    }
+
+    /// The number of non-empty lines of the corpus, once the first pass is complete.
+    std::size_t no_of_lines() const {
+        return lines;
+    }
+
+    /*
+     * Reads the lines of a text corpus (one sentence per line, the words are separated by blanks
+     * or tabs) into the corpus, until it has at least max_symbols words or the stream ends. The sentences
+     * with a word that is not in the signature are left out and reported, if report_errors is set.
+     * line_no is the number of the next line of the stream. Returns the number of non-empty lines.
+     */
+    static unsigned read_lines(std::istream& in, const ExtSignature& signature, Corpus& corpus, std::size_t max_symbols,
+            unsigned& line_no, bool report_errors = true) {
+        typedef boost::char_separator<char> CharSeparator;
+        typedef boost::tokenizer<CharSeparator> Tokenizer;
+
+        std::string line;
+        std::vector<Symbol> tokens_id;
+        unsigned lines = 0;
+        while (corpus.no_of_symbols() < max_symbols && std::getline(in, line)) {
+            if (!line.empty()) {
+                PCFGEM_VLOG(6) << "EMTrainer: Reading in line " << line_no << ": '" << line << "'.";
+                Tokenizer tokens(line, CharSeparator("\t "));
+                tokens_id.clear();
+                bool valid = true;
+
+                for (const std::string& word : tokens) {
+                    Symbol word_as_id = signature.resolve_symbol(word);
+                    if (word_as_id < 0) { // If a terminal symbol was not found, the sentence is invalid.
+                        if (report_errors) {
+                            LOG(ERROR) << "EMTrainer: Sentence in line " << line_no << " will be ignored, the token '" << word << "' cannot be resolved.";
+                        }
+                        valid = false;
+                    }
+                    tokens_id.push_back(word_as_id);
+                }
+
+                ++lines;
+                if (valid && !tokens_id.empty()) {
+                    corpus.add(tokens_id);
+                }
+            }
+            ++line_no;
+        }
+        return lines;
+    }
+
+private:
+    /// The memory of a block per word: the word itself and its share of the offsets, counts and the hash set of its sentence.
+    static const std::size_t bytes_per_symbol = 8;
+
+    std::string                     path;
+    const ExtSignature&             signature;
+    std::size_t                     max_block_bytes;    ///< The memory of a block
+    bool                            first_pass;         ///< Unknown words are only reported once
+    bool                            failed;             ///< The text corpus could not be read completely
+    unsigned                        line_no;            ///< The next line of the text corpus
+    std::size_t                     lines;              ///< The non-empty lines of the corpus
+    std::unique_ptr<std::istream>   text;               ///< The text corpus, if it is not encoded
+    std::unique_ptr<EncodedCorpus>  encoded;            ///< The encoded corpus, if it is one
+    std::vector<Symbol>             translation;        ///< The symbols for the words of the encoded corpus
+    std::uint64_t                   next_sentence;      ///< The next sentence of the encoded corpus
+};
+
+#endif	/* CORPUSSTREAM_HPP */
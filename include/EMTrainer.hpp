@@ -9,45 +9,151 @@
 #define	EMTRAINER_HPP
 
 #include <iostream>
-#include <unordered_map>
 
 #include "ProbabilisticContextFreeGrammar.hpp"
 #include "InsideOutsideCalculator.hpp"
+#include "ChartInsideOutsideCalculator.hpp"
+#include "InsideOutsideKernel.hpp"
+#include "CompiledGrammar.hpp"
+#include "ExpectedCounts.hpp"
+#include "WorkStealingPool.hpp"
+#include "ParseForest.hpp"
+#include "ChartArena.hpp"
+#include "ForestStore.hpp"
+#include "InsideSpanCache.hpp"
+#include "Corpus.hpp"
+#include "EncodedCorpus.hpp"
+#include "CorpusStream.hpp"
+#include "ParallelCorpusLoader.hpp"
 #include "Signature.hpp"
 #include "PCFGRule.hpp"
 
 #include <boost/tokenizer.hpp>
+#include <boost/iterator/counting_iterator.hpp>
+#include <boost/functional/hash.hpp>
+#include <unordered_map>
 #include <sstream>
 #include <cmath>
 #include <limits>       // std::numeric_limits
 #include <cmath>
+#include <algorithm>
+#include <memory>
+#include <future>
 
-#include "../include/easylogging++.h"
+#include "../include/Tracing.hpp"
 
 /// Learns the probability distribution of a grammar based on raw, not annotated sentences.
 class EMTrainer {
 public:
     typedef ProbabilisticContextFreeGrammar::Probability    Probability;
+
+    /// The algorithm that is used to calculate inside and outside values.
+    enum Engine {
+        CHART,      ///< ChartInsideOutsideCalculator: dense chart, filled bottom-up and top-down
+        RECURSIVE   ///< InsideOutsideCalculator: recursion with a hash map as cache
+    };
+
+    /// The storage of the cache of the recursive engine (see InsideOutsideStorage.hpp).
+    enum CacheStorage {
+        AUTO_STORAGE,       ///< DENSE_TRIANGULAR if its array is small enough, else FLAT_MAP
+        NODE_MAP,           ///< NodeMapStorage: std::unordered_map
+        FLAT_MAP,           ///< FlatMapStorage: open addressing
+        DENSE_TRIANGULAR,   ///< DenseTriangularStorage: a slot for every nonterminal and span
+        SPARSE_CELLS        ///< SparseCellStorage: a short list of symbols per span
+    };
 private:
-    typedef boost::char_separator<char>                     CharSeparator;
-    typedef boost::tokenizer<CharSeparator>                 Tokenizer;
     typedef std::string                                     ExternalSymbol;
     typedef std::vector<ExternalSymbol>                     StringVector;
     typedef ProbabilisticContextFreeGrammar::Symbol         Symbol;
     typedef std::vector<Symbol>                             SymbolVector;
-    typedef std::pair<SymbolVector, bool>                   SentenceTuple;
-    typedef std::vector<SentenceTuple>                      SentencesVector;
-    typedef std::unordered_map<Symbol, Probability>         SymbolToProbMap;
-    typedef std::unordered_map<PCFGRule, Probability, PCFGRule::Hasher>       RuleToProbMap;
+    typedef ProbabilisticContextFreeGrammar::RuleID         RuleID;
+    typedef ProbabilisticContextFreeGrammar::NonterminalID  NonterminalID;
 
+    /// The life cycle of the cached parse forests.
+    enum ForestState {
+        NO_FORESTS,     ///< estimate with the chart
+        RECORD_FORESTS, ///< estimate with the chart and record the forests
+        USE_FORESTS     ///< estimate with the recorded forests
+    };
 
 public:
-    EMTrainer(ProbabilisticContextFreeGrammar& pcfg, std::istream& corpus) :
-    grammar(pcfg), signature(pcfg.get_signature()) {
-        no_of_sentences = 0;
+    EMTrainer(ProbabilisticContextFreeGrammar& pcfg, std::istream& corpus) : EMTrainer(pcfg) {
         read_in(corpus);
     }
 
+    /// Reads the sentences from a corpus that was encoded with 'pcfgem encode-corpus' (see EncodedCorpus).
+    EMTrainer(ProbabilisticContextFreeGrammar& pcfg, const EncodedCorpus& corpus) : EMTrainer(pcfg) {
+        no_of_sentences = corpus.no_of_lines();
+        corpus.read(signature, sentences);
+        PCFGEM_VLOG(2) << "EMTrainer: Read in " << no_of_sentences << " sentences, " << sentences.size() << " of them are different and valid.";
+    }
+
+    /// Reads the sentences of a text corpus in several threads (see ParallelCorpusLoader), with the same result as read_in.
+    EMTrainer(ProbabilisticContextFreeGrammar& pcfg, const ParallelCorpusLoader& corpus) : EMTrainer(pcfg) {
+        PCFGEM_VLOG(4) << "EMTrainer: Reading in the training corpus...";
+        no_of_sentences = corpus.read(signature, sentences);
+        PCFGEM_VLOG(2) << "EMTrainer: Read in " << no_of_sentences << " sentences, " << sentences.size() << " of them are different and valid.";
+    }
+
+    /// Reads the sentences from the stream in every iteration, so they are never all in memory at the same time.
+    /// The forests are not cached in this mode. The stream must exist as long as the trainer.
+    EMTrainer(ProbabilisticContextFreeGrammar& pcfg, CorpusStream& corpus) : EMTrainer(pcfg) {
+        stream = &corpus;
+    }
+
+    /// Estimate the sentences in the given number of threads. Default: 1
+    void set_threads(unsigned threads) {
+        no_of_threads = std::max(1u, threads);
+    }
+
+    /// Fill the chart of each sentence in the given number of threads. Default: 1
+    /// This helps when there are only a few, long sentences, e.g. to score a single sentence quickly.
+    void set_chart_threads(unsigned threads) {
+        chart_threads = std::max(1u, threads);
+    }
+
+    /// Record the parse forest of every sentence after the grammar has been cleaned, and only run
+    /// the inside and outside passes over these forests in the following iterations. Default: true
+    /// Only used by the chart engine.
+    void set_cache_forests(bool cache) {
+        cache_forests = cache;
+    }
+
+    /// Keep the recorded forests in the given file instead of the memory. The decoded forests use
+    /// at most about the given number of bytes. Default: no file
+    void set_forest_store(const std::string& path, std::size_t memory_budget) {
+        forest_store_path = path;
+        forest_budget = memory_budget;
+    }
+
+    /// Share the inside values of equal word sequences of at least min_length words between the sentences,
+    /// using about the given number of bytes. The cache is cleared in every iteration. Default: no cache
+    void set_span_cache(std::size_t memory_budget, unsigned min_length = 3) {
+        span_cache.reset(memory_budget > 0 ? new InsideSpanCache(memory_budget, min_length) : nullptr);
+    }
+
+    /// Choose the engine for the inside and outside calculations. Default: CHART
+    void set_engine(Engine new_engine) {
+        engine = new_engine;
+    }
+
+    /// Choose the storage of the cache of the recursive engine. Default: AUTO_STORAGE
+    void set_cache_storage(CacheStorage storage) {
+        cache_storage = storage;
+    }
+
+    /// Choose the instruction set for the kernels of the chart engine. Default: the best one of this CPU.
+    /// If the CPU does not support the given set, the next lower one is used.
+    void set_instruction_set(InsideOutsideKernel::InstructionSet set) {
+        kernel = InsideOutsideKernel(set);
+        PCFGEM_VLOG(1) << "EMTrainer: Using the " << InsideOutsideKernel::name(kernel.get_instruction_set()) << " kernels.";
+    }
+
+    /// Choose how the chart engine represents the values. Default: SCALED
+    void set_arithmetic(ChartInsideOutsideCalculator::Arithmetic mode) {
+        arithmetic = mode;
+    }
+
     /// Perfom the EM training exactly x times.
     void train(unsigned no_of_loops) {
         bool cleaned = false;
@@ -61,14 +167,14 @@ public:
 
             // clean the grammar only after the first iteration.
             if (!cleaned) {
-                grammar.clean_grammar();
+                clean_grammar();
                 cleaned = true;
             }
             // std::cerr << "After Clean\n" << grammar << "\n";
 
         }
 
-        VLOG(1) << "EMTrainer: Completed after " << no_of_loops << " iterations with a RMSE = " << last_changes << ".";
+        PCFGEM_VLOG(1) << "EMTrainer: Completed after " << no_of_loops << " iterations with a RMSE = " << last_changes << ".";
 
     }
 
@@ -84,82 +190,139 @@ public:
 
             // clean the grammar only after the first iteration.
             if (!cleaned) {
-                grammar.clean_grammar();
+                clean_grammar();
                 cleaned = true;
             }
         }
 
-        VLOG(1) << "EMTrainer: Completed " << iterations << " iterations until RMSE was " << last_changes << " (<= " << threshold << ").";
+        PCFGEM_VLOG(1) << "EMTrainer: Completed " << iterations << " iterations until RMSE was " << last_changes << " (<= " << threshold << ").";
     }
 
 
 private:
+    explicit EMTrainer(ProbabilisticContextFreeGrammar& pcfg) :
+    grammar(pcfg), signature(pcfg.get_signature()), no_of_sentences(0), active_sentences(&sentences), stream(nullptr), engine(CHART), cache_storage(AUTO_STORAGE), arithmetic(ChartInsideOutsideCalculator::SCALED), no_of_threads(1), chart_threads(1), cache_forests(true), forest_state(NO_FORESTS), forests_first(0), forest_budget(0), scheduled_threads(0), peak_arena_allocations(0) {
+    }
+
+    /// Removes the rules with probability 0. From now on, the set of rules with a nonzero probability
+    /// can only shrink, so the forests that are recorded in the next iteration stay valid.
+    void clean_grammar() {
+        grammar.clean_grammar();
+        if (cache_forests && engine == CHART && stream == nullptr) {
+            forest_state = RECORD_FORESTS;
+            forest_recorded.assign(sentences.size(), false);
+            if (forest_store_path.empty()) {
+                forests.assign(sentences.size(), ParseForest());
+            } else {
+                forest_store.reset(new ForestStore(forest_store_path, forest_budget));
+                if (!forest_store->is_open()) {
+                    forest_store.reset();
+                    forest_state = NO_FORESTS;
+                }
+            }
+        }
+    }
+
     double train() {
-        SymbolToProbMap symbol_prob;
-        RuleToProbMap rule_prob;
         bool training_performed = false;
 
         double rmsq_sum = 0;
         unsigned rmsq_n = 0;
 
         // First, iterate over all sentences and sum up the estimations for the rules and the sentences themselves.
-        VLOG(2) << "EMTrainer: Estimate probabilities for " << no_of_sentences << " sentences.";
-        for (SentencesVector::const_iterator cit = sentences.begin(); cit != sentences.end(); ++cit) {
-            if (cit->second != false) {
-                training_performed = true; // in case there are no valid sentences in the training data
-                InsideOutsideCache cache(grammar);
-                InsideOutsideCalculator iocalc(cache, &(cit->first));
-
-                unsigned len = (cit->first).size();
-                VLOG(3) << "EMTrainer: Current sentence: '" << symbol_vector_to_string(cit->first) << "'";
-
-                // Calculate the inside probabiliy for the whole sentence first.
-                // in M&S this varible is called "Pi" and defined as
-                // P(w_1m | G) = P(N^1 =>* w_1m | G) = Beta_1(1,m)
-                Probability inside_sentence = iocalc.calculate_inside(grammar.get_start_symbol(), 0, len-1);
-                VLOG(4) << "EMTrainer: Inside Probability for the whole sentence is " << inside_sentence;
-
-                if (inside_sentence > 0) {
-                    // Estimate how many times a nonterminal was is in the current sentence
-                    for (Symbol nt : grammar.get_nonterminals()) {
-                        symbol_prob[nt] += estimate_symbol_expectation(nt, len, inside_sentence, iocalc);
-                    }
-
-                    // Estimate how many times a rule is used.
-                    for (ProbabilisticContextFreeGrammar::iterator rule = grammar.begin(); rule != grammar.end(); ++rule) {
-
-                        if (rule->arity() == 2) { // Normal rules -> (11.26), p. 400
-                            rule_prob[*rule] += estimate_rule_expectation((*rule), len, inside_sentence, iocalc);
-
-                        } else { // Preterminal rules -> (11.27), p. 400
-                            rule_prob[*rule] += estimate_terminal_rule_expectation((*rule), len, cit->first, inside_sentence, iocalc) ;
-                        }
+        if (stream == nullptr) {
+            PCFGEM_VLOG(2) << "EMTrainer: Estimate probabilities for " << no_of_sentences << " sentences (" << sentences.size() << " different ones).";
+        }
+        // The counts are indexed by the dense IDs of the grammar. Their memory is reused in every iteration.
+        expectations.reset(grammar.no_of_rules(), grammar.no_of_nonterminals());
+        // The chart engine reads the rules from a compiled snapshot of the grammar with the current probabilities.
+        CompiledGrammar compiled(grammar);
+        // Every thread reuses the memory of its arena for all of its sentences.
+        if (arenas.size() < no_of_threads) {
+            arenas.resize(no_of_threads);
+        }
+        std::size_t arena_allocations = count_arena_allocations();
+        // The cached inside values belong to the probabilities of the last iteration.
+        if (span_cache) {
+            span_cache->clear();
+        }
+        // The forests read the probabilities by the dense rule IDs.
+        if (forest_state == USE_FORESTS) {
+            rule_probs.resize(grammar.no_of_rules());
+            for (RuleID r = 0; r < grammar.no_of_rules(); ++r) {
+                rule_probs[r] = grammar.get_rule(r).get_prob();
+            }
+        }
+        if (stream != nullptr) {
+            training_performed = estimate_stream(compiled);
+        } else {
+            training_performed = estimate_corpus(compiled);
+        }
+        if (forest_state == USE_FORESTS && forest_store) {
+            // The sentences without a forest have been estimated above, now stream through the stored ones.
+            forest_store->for_each_shard([this, &training_performed](const ForestStore::Shard& shard) {
+                bool performed = estimate_in_chunks(shard.forests.size(), [this, &shard](unsigned first, unsigned last, ExpectedCounts& counts, ChartArena& arena) {
+                    for (unsigned f = first; f < last; ++f) {
+                        counts.set_weight(sentences.count(shard.sentences[f]));
+                        arena.reset();
+                        Probability log_inside_sentence = shard.forests[f].estimate(rule_probs, counts, &arena);
+                        PCFGEM_VLOG(4) << "EMTrainer: Log inside Probability for sentence " << shard.sentences[f] << " is " << log_inside_sentence;
                     }
-                } else {
-                    VLOG(4) << "EMTrainer: Skipping sentence because of 0-probability.";
-                }
+                    counts.set_weight(1);
+                    return first < last;
+                });
+                training_performed = training_performed || performed;
+            });
+        }
+        report_arenas(count_arena_allocations() - arena_allocations);
+        if (span_cache) {
+            InsideSpanCache::Statistics cache_stats = span_cache->get_statistics();
+            PCFGEM_VLOG(2) << "EMTrainer: Span cache: " << cache_stats.hits << " hits in " << cache_stats.lookups << " lookups ("
+                    << 100 * cache_stats.hit_rate() << "%), " << cache_stats.insertions << " insertions, " << cache_stats.evictions
+                    << " evictions, " << cache_stats.bytes / 1024 << " KiB.";
+        }
+        if (forest_state == RECORD_FORESTS && forest_store) {
+            forest_state = USE_FORESTS;
+            if (!forest_store->finish()) {
+                // Without the forests, every sentence is estimated with the chart again.
+                forest_store.reset();
+                forest_state = NO_FORESTS;
+            }
+        } else if (forest_state == RECORD_FORESTS) {
+            forest_state = USE_FORESTS;
+            std::size_t items = 0, edges = 0, bytes = 0;
+            unsigned recorded = 0;
+            for (unsigned s = 0; s < forests.size(); ++s) {
+                recorded += forest_recorded[s];
+                items += forests[s].no_of_items();
+                edges += forests[s].no_of_edges();
+                bytes += forests[s].memory_usage();
             }
+            PCFGEM_VLOG(2) << "EMTrainer: Recorded the parse forests of " << recorded << " sentences with " << items << " items and "
+                    << edges << " edges (" << bytes / 1024 << " KiB), the others stay with the chart.";
         }
         if (training_performed) {
             // Now that all sentences have been processed, it is time for the maximisation step:
             // Maximize the probability of the rules in the grammar
-            VLOG(2) << "EMTrainer: Maximize the probabilities of all rules in the grammar.";
-            for (ProbabilisticContextFreeGrammar::iterator rule = grammar.begin(); rule != grammar.end(); ++rule) {
-                assert(symbol_prob.find(rule->get_lhs()) != symbol_prob.end());
+            PCFGEM_VLOG(2) << "EMTrainer: Maximize the probabilities of all rules in the grammar.";
+            for (RuleID r = 0; r < grammar.no_of_rules(); ++r) {
+                PCFGRule& rule = grammar.get_rule(r);
+                NonterminalID lhs = grammar.get_nonterminal_id(rule.get_lhs());
+                assert(lhs >= 0);
 
-                Probability summed_sentence_estimation = symbol_prob[rule->get_lhs()];
+                Probability summed_sentence_estimation = expectations.get_symbol_count(lhs);
                 Probability new_prob;
                 // Divide the summed up estimation for all rules by the summed up estimation of the symbol on the lhs.
                 if (summed_sentence_estimation > 0) { // avoid division by 0
-                    new_prob = rule_prob[*rule] / summed_sentence_estimation;
-                    rmsq_sum += std::pow(rule->get_prob() - new_prob, 2);
+                    new_prob = expectations.get_rule_count(r) / summed_sentence_estimation;
+                    rmsq_sum += std::pow(rule.get_prob() - new_prob, 2);
                     ++rmsq_n;
                 } else {
                     ++rmsq_n;
                     new_prob = 0;
                 }
-                VLOG(9) << "EMTrainer: Updating probability for rule '" << *rule << "'. New: " << new_prob;
-                rule->set_probability(new_prob);
+                PCFGEM_VLOG(9) << "EMTrainer: Updating probability for rule '" << rule << "'. New: " << new_prob;
+                rule.set_probability(new_prob);
             }
 
 //            assert(grammar.is_valid_pcfg());
@@ -168,14 +331,353 @@ private:
         }
 
 
-        VLOG(2) << "EMTrainer: Root mean square error compared to the last iteration: " << std::sqrt(rmsq_sum/rmsq_n);
+        PCFGEM_VLOG(2) << "EMTrainer: Root mean square error compared to the last iteration: " << std::sqrt(rmsq_sum/rmsq_n);
         return std::sqrt(rmsq_sum/rmsq_n);
 
     }
 
+    /// Estimates all sentences of active_sentences, in parallel, if there are several threads.
+    /// Returns true, if there was at least one sentence.
+    bool estimate_corpus(const CompiledGrammar& compiled) {
+        if (forest_state == RECORD_FORESTS && forest_store) {
+            return record_forests_to_store(compiled);
+        } else if (no_of_threads <= 1) {
+            return estimate_sentences(compiled, boost::counting_iterator<unsigned>(0),
+                    boost::counting_iterator<unsigned>(active_sentences->size()), expectations, arenas[0]);
+        } else {
+            bool training_performed = false;
+            // Every block of the schedule has its own counts, which are added up in the order of the blocks.
+            // So the result does not depend on which thread estimated which block.
+            if (scheduled_threads != no_of_threads) {
+                schedule_sentences();
+            }
+            unsigned no_of_blocks = block_offsets.size() - 1;
+            block_expectations.resize(no_of_blocks);
+            std::vector<char> block_performed(no_of_blocks, false);
+
+            WorkStealingPool pool(no_of_threads);
+            pool.run(no_of_blocks, [this, &compiled, &block_performed](unsigned block, unsigned worker) {
+                block_expectations[block].reset(grammar.no_of_rules(), grammar.no_of_nonterminals());
+                block_performed[block] = estimate_sentences(compiled, schedule.data() + block_offsets[block],
+                        schedule.data() + block_offsets[block + 1], block_expectations[block], arenas[worker]);
+            });
+
+            for (unsigned b = 0; b < no_of_blocks; ++b) {
+                expectations.add(block_expectations[b]);
+                training_performed = training_performed || block_performed[b];
+            }
+
+            const WorkStealingPool::Statistics& stats = pool.get_statistics();
+            PCFGEM_VLOG(2) << "EMTrainer: Estimation took " << stats.wall_seconds << "s in " << no_of_threads << " threads, utilisation "
+                    << 100 * stats.utilisation() << "% (busy time per thread " << stats.min_busy_seconds() << "s - "
+                    << stats.max_busy_seconds() << "s, " << stats.total_steals() << " of " << no_of_blocks << " blocks stolen).";
+            return training_performed;
+        }
+    }
+
+    /*
+     * Streams the corpus through the estimation: The sentences are read in blocks and, while the
+     * sentences of one block are estimated, the next block is read and tokenized by another thread
+     * into the second buffer. So at most two blocks are in memory and the reading is hidden behind
+     * the estimation, as long as it is faster.
+     */
+    bool estimate_stream(const CompiledGrammar& compiled) {
+        bool training_performed = false;
+        unsigned no_of_blocks = 0;
+        unsigned current = 0;
+        stream->rewind();
+        std::future<bool> next = std::async(std::launch::async, &CorpusStream::read_block, stream, std::ref(stream_blocks[current]));
+        while (next.get()) {
+            active_sentences = &stream_blocks[current];
+            next = std::async(std::launch::async, &CorpusStream::read_block, stream, std::ref(stream_blocks[1 - current]));
+            // The schedule belongs to the sentences of the block.
+            scheduled_threads = 0;
+            training_performed = estimate_corpus(compiled) || training_performed;
+            current = 1 - current;
+            ++no_of_blocks;
+        }
+        active_sentences = &sentences;
+        scheduled_threads = 0;
+        no_of_sentences = stream->no_of_lines();
+        PCFGEM_VLOG(2) << "EMTrainer: Streamed " << no_of_sentences << " sentences in " << no_of_blocks << " blocks from the disk.";
+        return training_performed;
+    }
+
+    /// Estimates the sentences with the given indices and adds their expectations to the given counts.
+    /// Only reads the grammar and writes nothing but the forests of the given sentences, so several threads
+    /// can call this function at the same time for different sentences with their own counts.
+    /// The charts and caches of the sentences are taken from the given arena of the calling thread.
+    /// Returns true, if there was at least one sentence.
+    template <typename IndexIterator>
+    bool estimate_sentences(const CompiledGrammar& compiled, IndexIterator first, IndexIterator last, ExpectedCounts& counts, ChartArena& arena) {
+        bool training_performed = false;
+        // The calculators read the words from a vector, its memory is reused for all sentences.
+        SymbolVector sentence;
+        for (IndexIterator i = first; i != last; ++i) {
+            training_performed = true; // the corpus only contains valid sentences
+            // A sentence that occurs several times in the corpus is only estimated once.
+            counts.set_weight(active_sentences->count(*i));
+            // The memory of the last sentence is not needed anymore.
+            arena.reset();
+            active_sentences->copy_sentence(*i, sentence);
+            PCFGEM_VLOG(3) << "EMTrainer: Current sentence: '" << symbol_vector_to_string(sentence) << "'";
+
+            if (engine == RECURSIVE) {
+                if (sentence.size() > InsideOutsideCache<>::max_sentence_length()) {
+                    LOG(WARNING) << "EMTrainer: Skipping a sentence with " << sentence.size() << " tokens, the recursive engine supports at most "
+                            << InsideOutsideCache<>::max_sentence_length() << ". Use the chart engine instead.";
+                    continue;
+                }
+                estimate_recursive(sentence, counts, arena);
+            } else if (forest_state == USE_FORESTS && forest_recorded[*i]) {
+                if (forest_store) {
+                    continue; // estimated while streaming through the store
+                }
+                // Only the edges of the recorded forest are visited, with the current probabilities.
+                Probability log_inside_sentence = forests[*i].estimate(rule_probs, counts, &arena);
+                PCFGEM_VLOG(4) << "EMTrainer: Log inside Probability for the whole sentence is " << log_inside_sentence;
+                if (std::isinf(log_inside_sentence)) {
+                    PCFGEM_VLOG(4) << "EMTrainer: Skipping sentence because of 0-probability.";
+                }
+            } else {
+                // The chart engine collects all expectations while computing the outside values.
+                ChartInsideOutsideCalculator iocalc(compiled, &sentence, &counts, kernel, arithmetic, chart_threads, span_cache.get(), &arena);
+                // The probability itself can underflow for long sentences, its logarithm cannot.
+                Probability log_inside_sentence = iocalc.calculate_log_inside(grammar.get_start_symbol(), 0, sentence.size() - 1);
+                PCFGEM_VLOG(4) << "EMTrainer: Log inside Probability for the whole sentence is " << log_inside_sentence;
+                if (std::isinf(log_inside_sentence)) {
+                    PCFGEM_VLOG(4) << "EMTrainer: Skipping sentence because of 0-probability.";
+                }
+                if (forest_state == RECORD_FORESTS) {
+                    record_forest(compiled, *i, sentence, iocalc);
+                }
+            }
+        }
+        counts.set_weight(1);
+        return training_performed;
+    }
+
+    /// Estimates a sentence with the recursive engine and the chosen cache storage.
+    void estimate_recursive(const SymbolVector& sentence, ExpectedCounts& counts, ChartArena& arena) const {
+        CacheStorage storage = cache_storage;
+        if (storage == AUTO_STORAGE) {
+            // The dense array needs no hashing at all, as long as it is cheap to allocate and clear.
+            storage = DenseTriangularStorage::memory_usage(grammar, sentence.size()) <= max_dense_cache ? DENSE_TRIANGULAR : FLAT_MAP;
+        }
+        switch (storage) {
+            case NODE_MAP:
+                estimate_recursive<NodeMapStorage>(sentence, counts, arena);
+                break;
+            case DENSE_TRIANGULAR:
+                estimate_recursive<DenseTriangularStorage>(sentence, counts, arena);
+                break;
+            case SPARSE_CELLS:
+                estimate_recursive<SparseCellStorage>(sentence, counts, arena);
+                break;
+            default:
+                estimate_recursive<FlatMapStorage>(sentence, counts, arena);
+        }
+    }
+
+    template <typename Storage>
+    void estimate_recursive(const SymbolVector& sentence, ExpectedCounts& counts, ChartArena& arena) const {
+        InsideOutsideCache<Storage> cache(grammar, sentence.size(), &arena);
+        InsideOutsideCalculator<Storage> iocalc(cache, &sentence);
+        estimate_sentence(sentence, iocalc, counts);
+    }
+
+    /*
+     * Keeps the forest of a sentence, if it is small enough: Its edges are visited one by one,
+     * while the chart runs the vectorised kernels over all split points. If the grammar is so
+     * ambiguous that hardly anything is pruned, the sentence stays with the chart. Most of the
+     * recording can be skipped for such a sentence, since already most of its items are useful.
+     */
+    void record_forest(const CompiledGrammar& compiled, unsigned index, const SymbolVector& sentence, const ChartInsideOutsideCalculator& iocalc) {
+        double n = sentence.size();
+        double cells = compiled.no_of_nonterminals() * n * (n + 1) / 2;
+        double applications = compiled.get_binary_rules().size() * (n * n * n - n) / 6 + n;
+        ParseForest& forest = forests[index - forests_first];
+        forest = ParseForest(compiled, sentence, iocalc, max_forest_items * cells, max_forest_density * applications);
+        // An empty forest is only kept, if the sentence has no derivation at all.
+        bool parsed = !std::isinf(iocalc.calculate_log_inside(grammar.get_start_symbol(), 0, sentence.size() - 1));
+        forest_recorded[index] = forest.has_derivation() || !parsed;
+    }
+
+    /*
+     * The iteration that records the forests for the store: The sentences are estimated in
+     * batches in the order of the corpus, and the forests of each batch are written to the store
+     * before the next batch starts. The size of the batches adapts to the size of the forests,
+     * so that the forests of one batch take about as much memory as one shard.
+     */
+    bool record_forests_to_store(const CompiledGrammar& compiled) {
+        bool training_performed = false;
+        unsigned batch_size = std::max(1u, no_of_threads) * blocks_per_thread;
+        for (unsigned first = 0; first < active_sentences->size(); ) {
+            unsigned last = std::min<std::size_t>(active_sentences->size(), std::size_t(first) + batch_size);
+            forests_first = first;
+            forests.assign(last - first, ParseForest());
+            bool performed = estimate_in_chunks(last - first, [this, &compiled, first](unsigned begin, unsigned end, ExpectedCounts& counts, ChartArena& arena) {
+                return estimate_sentences(compiled, boost::counting_iterator<unsigned>(first + begin),
+                        boost::counting_iterator<unsigned>(first + end), counts, arena);
+            });
+            training_performed = training_performed || performed;
+
+            std::size_t bytes = 0;
+            for (unsigned i = first; i < last; ++i) {
+                const ParseForest& forest = forests[i - first];
+                if (forest.has_derivation()) {
+                    forest_store->add(i, forest);
+                    bytes += forest.memory_usage() + sizeof(ParseForest);
+                }
+            }
+            if (bytes > 0) {
+                batch_size = std::max<std::size_t>(1, forest_store->shard_budget() * (last - first) / bytes);
+            }
+            first = last;
+        }
+        forests.clear();
+        forests.shrink_to_fit();
+        forests_first = 0;
+        return training_performed;
+    }
+
+    std::size_t count_arena_allocations() const {
+        std::size_t result = 0;
+        for (const ChartArena& arena : arenas) {
+            result += arena.allocations();
+        }
+        return result;
+    }
+
+    /// Logs how many blocks the arenas allocated in this iteration. After the longest sentence
+    /// of every thread has been processed once, this should stay at 0.
+    void report_arenas(std::size_t allocations) {
+        peak_arena_allocations = std::max(peak_arena_allocations, allocations);
+        std::size_t bytes = 0;
+        for (const ChartArena& arena : arenas) {
+            bytes += arena.peak_bytes();
+        }
+        PCFGEM_VLOG(2) << "EMTrainer: The arenas allocated " << allocations << " blocks in this iteration (peak: " << peak_arena_allocations
+                << " in one iteration), " << bytes / 1024 << " KiB for " << arenas.size() << " threads.";
+    }
+
+    /*
+     * Calls estimate(first, last, counts, arena) for parts of [0, no_of_items) and adds the counts to the
+     * expectations, the arena belongs to the calling thread. With several threads, the parts run on a WorkStealingPool, every part has its
+     * own counts and they are added in the order of the parts. Returns true, if one call did.
+     */
+    template <typename Function>
+    bool estimate_in_chunks(unsigned no_of_items, Function estimate) {
+        if (no_of_threads <= 1) {
+            return estimate(0, no_of_items, expectations, arenas[0]);
+        }
+        unsigned no_of_chunks = std::min<unsigned>(blocks_per_thread * no_of_threads, no_of_items);
+        if (block_expectations.size() < no_of_chunks) {
+            block_expectations.resize(no_of_chunks);
+        }
+        std::vector<char> chunk_performed(no_of_chunks, false);
+        WorkStealingPool pool(no_of_threads);
+        pool.run(no_of_chunks, [this, &estimate, &chunk_performed, no_of_items, no_of_chunks](unsigned chunk, unsigned worker) {
+            block_expectations[chunk].reset(grammar.no_of_rules(), grammar.no_of_nonterminals());
+            chunk_performed[chunk] = estimate(std::size_t(no_of_items) * chunk / no_of_chunks,
+                    std::size_t(no_of_items) * (chunk + 1) / no_of_chunks, block_expectations[chunk], arenas[worker]);
+        });
+        bool performed = false;
+        for (unsigned c = 0; c < no_of_chunks; ++c) {
+            expectations.add(block_expectations[c]);
+            performed = performed || chunk_performed[c];
+        }
+        return performed;
+    }
+
+    /*
+     * Prepares the parallel estimation: The costs of a sentence grow with the cube of its length,
+     * so the valid sentences are ordered by decreasing length (a counting sort over the length
+     * histogram of the corpus) and then cut into blocks of about the same costs, a few per thread.
+     * The WorkStealingPool hands out the blocks with the longest sentences first and balances
+     * the rest, since the real costs also depend on how many rules can be applied.
+     */
+    void schedule_sentences() {
+        unsigned max_length = 0;
+        for (unsigned i = 0; i < active_sentences->size(); ++i) {
+            max_length = std::max(max_length, active_sentences->length(i));
+        }
+
+        std::vector<unsigned> histogram(max_length + 1, 0);
+        for (unsigned i = 0; i < active_sentences->size(); ++i) {
+            ++histogram[active_sentences->length(i)];
+        }
+
+        // position[len] is the place of the next sentence of this length in the schedule.
+        std::vector<unsigned> position(max_length + 1, 0);
+        unsigned no_of_valid = 0;
+        double total_costs = 0;
+        for (unsigned len = max_length; len > 0; --len) {
+            position[len] = no_of_valid;
+            no_of_valid += histogram[len];
+            total_costs += histogram[len] * std::pow(double(len), 3);
+        }
+        schedule.assign(no_of_valid, 0);
+        for (unsigned i = 0; i < active_sentences->size(); ++i) {
+            schedule[position[active_sentences->length(i)]++] = i;
+        }
+
+        unsigned no_of_blocks = std::min<unsigned>(blocks_per_thread * no_of_threads, no_of_valid);
+        double block_costs = no_of_blocks > 0 ? total_costs / no_of_blocks : 0;
+        double costs = 0;
+        block_offsets.assign(1, 0);
+        for (unsigned i = 0; i < no_of_valid; ++i) {
+            costs += std::pow(double(active_sentences->length(schedule[i])), 3);
+            if (costs >= block_costs * block_offsets.size() && block_offsets.size() < no_of_blocks) {
+                block_offsets.push_back(i + 1);
+            }
+        }
+        if (block_offsets.back() != no_of_valid) {
+            block_offsets.push_back(no_of_valid);
+        }
+        scheduled_threads = no_of_threads;
+
+        PCFGEM_VLOG(4) << "EMTrainer: Scheduled " << no_of_valid << " sentences in " << block_offsets.size() - 1 << " blocks for " << no_of_threads << " threads.";
+    }
+
+    /// Adds the expectations of all symbols and rules for one sentence to the expected counts.
+    /// The calculator can be any engine that offers calculate_inside() and calculate_outside().
+    template <typename Calculator>
+    void estimate_sentence(const SymbolVector& sentence, Calculator& iocalc, ExpectedCounts& counts) const {
+        unsigned len = sentence.size();
+
+        // Calculate the inside probabiliy for the whole sentence first.
+        // in M&S this varible is called "Pi" and defined as
+        // P(w_1m | G) = P(N^1 =>* w_1m | G) = Beta_1(1,m)
+        Probability inside_sentence = iocalc.calculate_inside(grammar.get_start_symbol(), 0, len-1);
+        PCFGEM_VLOG(4) << "EMTrainer: Inside Probability for the whole sentence is " << inside_sentence;
+
+        if (inside_sentence > 0) {
+            // Estimate how many times a nonterminal was is in the current sentence
+            for (NonterminalID nt = 0; nt < (NonterminalID) grammar.no_of_nonterminals(); ++nt) {
+                counts.add_symbol(nt, estimate_symbol_expectation(grammar.get_nonterminal_symbol(nt), len, inside_sentence, iocalc));
+            }
+
+            // Estimate how many times a rule is used.
+            for (RuleID r = 0; r < grammar.no_of_rules(); ++r) {
+                const PCFGRule& rule = grammar.get_rule(r);
+
+                if (rule.arity() == 2) { // Normal rules -> (11.26), p. 400
+                    counts.add_rule(r, estimate_rule_expectation(rule, len, inside_sentence, iocalc));
+
+                } else { // Preterminal rules -> (11.27), p. 400
+                    counts.add_rule(r, estimate_terminal_rule_expectation(rule, len, sentence, inside_sentence, iocalc));
+                }
+            }
+        } else {
+            PCFGEM_VLOG(4) << "EMTrainer: Skipping sentence because of 0-probability.";
+        }
+    }
+
     /// This function is an implementation of fig. (11.24) on p. 399 in Manning&Schuetze.
     /// It calculates the estimate for how many times a NT is used in the derivation of the current sentence.
-    Probability estimate_symbol_expectation(const Symbol& symbol, unsigned len, Probability pi, InsideOutsideCalculator& iocalc) {
+    template <typename Calculator>
+    Probability estimate_symbol_expectation(const Symbol& symbol, unsigned len, Probability pi, Calculator& iocalc) const {
         if (pi == 0) return 0; //FIX: if pi is zero, NaN will always be returned.
         // This is also only the case, if the sentece has an inside value of 0,
         // meaning that it could not be parsed. Therefore, a 0 should be returned here
@@ -191,13 +693,14 @@ private:
                 score += current_result;
             }
         }
-        VLOG(6) << "EMTrainer: Estimation for the symbol '" << signature.resolve_id(symbol) << "' is "<<score;
+        PCFGEM_VLOG(6) << "EMTrainer: Estimation for the symbol '" << signature.resolve_id(symbol) << "' is "<<score;
         return score;
     }
 
     /// Like estimate_symbol_expectationm, but for rules. See fig. (11.25) on p. 400 in Manning&Schuetze.
     /// Again, we do not divide the result by the inside probability of the whole sentence.
-    Probability estimate_rule_expectation(const PCFGRule& rule, unsigned len, Probability pi, InsideOutsideCalculator& iocalc) {
+    template <typename Calculator>
+    Probability estimate_rule_expectation(const PCFGRule& rule, unsigned len, Probability pi, Calculator& iocalc) const {
         // std::cerr << "Calling estimate_rule_expectation with " << rule << " len=" << len << " pi=" << pi << "\n";
 
         assert(rule.arity() == 2);
@@ -223,14 +726,15 @@ private:
                 score += inner_score / pi;
             }
         }
-        VLOG(6) << "EMTrainer: Estimation for the rule '" << rule << "': " << score;
+        PCFGEM_VLOG(6) << "EMTrainer: Estimation for the rule '" << rule << "': " << score;
         return score;
     }
 
     /// Like estimate_symbol_expectationm but for terminal rules.
     /// See Manning&Schuetze: p.400, (11.27). This function implements the numerator of the fraction,
     /// as the denumerator has been calculated in advance.
-    Probability estimate_terminal_rule_expectation(const PCFGRule& rule, unsigned len,  const SymbolVector& sentence, Probability pi, InsideOutsideCalculator& iocalc) {
+    template <typename Calculator>
+    Probability estimate_terminal_rule_expectation(const PCFGRule& rule, unsigned len,  const SymbolVector& sentence, Probability pi, Calculator& iocalc) const {
         assert(rule.arity() == 1);
 
         if (pi == 0) return 0; //FIX: if pi is zero, NaN will always be returned.
@@ -251,41 +755,21 @@ private:
             } // else: add 0 to the score.
         }
 
-        VLOG(6) << "EMTrainer: Estimation for the rule '" << rule << "': " << score;
+        PCFGEM_VLOG(6) << "EMTrainer: Estimation for the rule '" << rule << "': " << score;
         return score;
     }
 
+    /// Reads in the corpus. Identical valid sentences are stored once, together with the number of times they occur.
+    /// Sentences with an unknown word cannot get a probability above 0, so they are left out.
     void read_in(std::istream& corpus) {
-        std::string line;
         unsigned line_no = 1;
-        VLOG(4) << "EMTrainer: Reading in the training corpus...";
-        while (corpus.good()) {
-            std::getline(corpus, line);
-            if (!line.empty()) {
-                VLOG(6) << "EMTrainer: Reading in line " << line_no << ": '" << line << "'.";
-                // Tokenize line
-                Tokenizer tokens(line, CharSeparator("\t "));
-                SymbolVector tokens_id;;
-                bool valid = true;
-
-                for (ExternalSymbol word : tokens) {
-                    Symbol word_as_id = signature.resolve_symbol(word);
-                    if (word_as_id < 0) { // If a terminal symbol was not found, mark this sentence as invalid.
-                        LOG(ERROR) << "EMTrainer: Sentence in line " << line_no << " will be ignored, the token '" << word<< "' cannot be resolved.";
-                        valid = false;
-                    }
-                    tokens_id.push_back(word_as_id);
-                }
-
-                ++no_of_sentences;
-                sentences.push_back(SentenceTuple(tokens_id, valid));
-            }
-            ++line_no;
-        }
+        PCFGEM_VLOG(4) << "EMTrainer: Reading in the training corpus...";
+        no_of_sentences = CorpusStream::read_lines(corpus, signature, sentences, std::numeric_limits<std::size_t>::max(), line_no);
+        PCFGEM_VLOG(2) << "EMTrainer: Read in " << no_of_sentences << " sentences, " << sentences.size() << " of them are different and valid.";
     }
 
     /// Nice way to print a symbol vector (sentences)
-    std::string symbol_vector_to_string(const SymbolVector& vector) {
+    std::string symbol_vector_to_string(const SymbolVector& vector) const {
         std::stringstream sstream;
 
         for (Symbol sym : vector) {
@@ -299,7 +783,38 @@ private:
     ProbabilisticContextFreeGrammar& grammar; ///< the grammar (obvious)
     Signature<ExternalSymbol>& signature; ///< the signature
     unsigned no_of_sentences; ///< the number of sentences in the corpus
-    SentencesVector sentences; ///< a vector of the sentences in the training corpus
+    Corpus sentences; ///< the valid sentences of the training corpus, each distinct one once with the number of its occurrences
+    const Corpus * active_sentences; ///< the sentences that are estimated: all sentences or a block of the stream
+    CorpusStream * stream; ///< the corpus on the disk, if the sentences are streamed
+    Corpus stream_blocks[2]; ///< the block that is estimated and the block that is read
+    Engine engine; ///< the engine for the inside and outside calculations
+    CacheStorage cache_storage; ///< the storage of the cache of the recursive engine
+    InsideOutsideKernel kernel; ///< the vectorised loops of the chart engine
+    ChartInsideOutsideCalculator::Arithmetic arithmetic; ///< plain or scaled values in the chart engine
+    unsigned no_of_threads; ///< the number of threads for the estimation
+    unsigned chart_threads; ///< the number of threads per chart
+    bool cache_forests; ///< record the parse forests after cleaning the grammar
+    ForestState forest_state; ///< whether the forests are recorded or used in the next iteration
+    std::vector<ParseForest> forests; ///< the parse forest of each sentence, indexed like the sentences
+    std::vector<char> forest_recorded; ///< whether the forest of a sentence is used instead of the chart
+    unsigned forests_first; ///< the index of the sentence of forests[0], while the forests are recorded in batches
+    std::string forest_store_path; ///< where the forests are stored, empty to keep them in memory
+    std::size_t forest_budget; ///< the memory for the decoded forests of the store
+    std::unique_ptr<ForestStore> forest_store; ///< the forests of all sentences, if they are not kept in memory
+    std::unique_ptr<InsideSpanCache> span_cache; ///< inside values of word sequences shared between the sentences, if any
+    ParseForest::ProbabilityVector rule_probs; ///< the current probabilities by rule ID, for the forests
+    ExpectedCounts expectations; ///< the expected counts of the current iteration, reused in every iteration
+    std::vector<unsigned> schedule; ///< indices of the valid sentences for the parallel estimation, longest first
+    std::vector<unsigned> block_offsets; ///< the blocks of the schedule, block b is [block_offsets[b], block_offsets[b + 1])
+    unsigned scheduled_threads; ///< the number of threads the schedule was made for, 0 if there is none
+    std::vector<ExpectedCounts> block_expectations; ///< the private counts of each block
+    std::vector<ChartArena> arenas; ///< the memory for the charts and caches of each thread, kept for all iterations
+    std::size_t peak_arena_allocations; ///< the most blocks the arenas allocated in one iteration
+
+    static constexpr double max_forest_items = 0.5; ///< forests with more items per cell of the chart are not recorded
+    static constexpr double max_forest_density = 0.25; ///< forests with more edges per rule application of the chart are not kept
+    static const std::size_t max_dense_cache = 64 << 20; ///< largest dense cache in bytes, that AUTO_STORAGE chooses
+    static const unsigned blocks_per_thread = 8; ///< blocks per thread in the schedule, more blocks balance better but need more counts
 };
 
 #endif	/* EMTRAINER_HPP */
@@ -0,0 +1,374 @@
+/*
+ * File:   EncodedCorpus.hpp
+ * Author: Johannes Gontrum
+ *
+ * A tokenized training corpus in a binary file, which is memory mapped instead of parsed.
+ */
+
+#ifndef ENCODEDCORPUS_HPP
+#define	ENCODEDCORPUS_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/tokenizer.hpp>
+
+#include "Corpus.hpp"
+#include "Signature.hpp"
+#include "Tracing.hpp"
+
+/*
+ * 'pcfgem encode-corpus CORPUS FILE' tokenizes a text corpus once and writes its distinct
+ * sentences as a flat array of word IDs with an array of offsets, so the trainer only has to
+ * translate the IDs instead of tokenizing and hashing every word.
+ *
+ * The IDs belong to a vocabulary of the corpus itself, which is stored in the file as well.
+ * When the corpus is read for a grammar, each word of the vocabulary is looked up once in the
+ * signature of the grammar, so the file can be used with any grammar (and its trained versions,
+ * whose signatures number the symbols differently).
+ *
+ * File format (numbers in the byte order of the encoding machine, every array starts at a
+ * multiple of 8 bytes):
+ *   header:   "PCFGCRP1", uint32 version, uint32 byte order mark, uint64 lines, uint64 words,
+ *             uint64 distinct sentences, uint64 symbols, uint32 has counts, uint32 0
+ *   arrays:   uint64 word offsets [words + 1], char word strings, uint64 sentence offsets
+ *             [sentences + 1], int32 symbols, uint32 counts [sentences] (only if has counts)
+ *
+ * The lines are the non-empty lines of the text corpus, the sentences occur 'counts' times in
+ * it (once, if the file has no counts).
+ */
+class EncodedCorpus {
+public:
+    typedef Corpus::Symbol                  Symbol;
+    typedef Signature<std::string>          ExtSignature;
+
+    static const std::uint32_t version = 1;
+
+public:
+    /// Maps the file. Check is_open() afterwards.
+    explicit EncodedCorpus(const std::string& file_path)
+    :
+    path(file_path),
+    mapping(nullptr),
+    mapping_size(0) {
+        map_file();
+    }
+
+    ~EncodedCorpus() {
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    EncodedCorpus(const EncodedCorpus&) = delete;
+    EncodedCorpus& operator=(const EncodedCorpus&) = delete;
+
+    bool is_open() const {
+        return mapping != nullptr;
+    }
+
+    /// True, if the file at the given path starts like an encoded corpus. Pipes are not checked (see GrammarImage::is_image).
+    static bool is_encoded(const std::string& file_path) {
+        struct stat status;
+        if (stat(file_path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+            return false;
+        }
+        char buffer[magic_size];
+        std::ifstream file(file_path, std::ios::in | std::ios::binary);
+        return file.read(buffer, magic_size) && std::memcmp(buffer, magic, magic_size) == 0;
+    }
+
+    /// The number of non-empty lines of the text corpus.
+    std::uint64_t no_of_lines() const {
+        return header.lines;
+    }
+
+    /*
+     * Adds the sentences to the corpus, with the words translated to the symbols of the signature.
+     * The sentences with a word that is not in the signature are left out. Returns the number
+     * of sentences (with repetitions) that are left out.
+     */
+    std::uint64_t read(const ExtSignature& signature, Corpus& corpus) const {
+        std::vector<Symbol> translation = translate(signature);
+        corpus.reserve(corpus.size() + header.sentences, corpus.no_of_symbols() + header.symbols);
+        std::uint64_t ignored = 0;
+        read(translation, corpus, 0, header.symbols, ignored);
+        PCFGEM_VLOG(2) << "EncodedCorpus: Read " << header.sentences << " distinct sentences with " << header.symbols
+                << " words from '" << path << "', " << ignored << " sentences are ignored.";
+        return ignored;
+    }
+
+    /// Looks up the words of the file in the signature. The result maps the IDs of the file to the
+    /// symbols of the signature, or to -1 for the unknown words, which are reported.
+    std::vector<Symbol> translate(const ExtSignature& signature) const {
+        const std::uint64_t * offsets = word_offsets();
+        const char * words = (const char*) (mapping + words_position());
+        std::vector<Symbol> translation(header.words);
+        for (std::uint64_t w = 0; w < header.words; ++w) {
+            std::string word(words + offsets[w], words + offsets[w + 1]);
+            translation[w] = signature.resolve_symbol(word);
+            if (translation[w] < 0) {
+                LOG(ERROR) << "EncodedCorpus: The sentences with the token '" << word << "' will be ignored, it cannot be resolved.";
+            }
+        }
+        return translation;
+    }
+
+    /*
+     * Adds the sentences from the given one on to the corpus, until they have at least max_symbols
+     * words, and returns the index of the next sentence (no_of_sentences() at the end). The words are
+     * translated with the result of translate(), the sentences with an unknown word are counted in ignored.
+     * The sentences of the file are distinct and translate() maps different words to different symbols,
+     * so they are appended without looking them up (see Corpus::append()). A word ID that is not in the
+     * vocabulary of the file makes the sentence invalid as well.
+     */
+    std::uint64_t read(const std::vector<Symbol>& translation, Corpus& corpus, std::uint64_t first, std::size_t max_symbols, std::uint64_t& ignored) const {
+        const std::uint64_t * offsets = (const std::uint64_t*) (mapping + sentence_offsets_position());
+        const Symbol * symbols = (const Symbol*) (mapping + symbols_position());
+        const std::uint32_t * counts = header.has_counts ? (const std::uint32_t*) (mapping + counts_position()) : nullptr;
+        std::vector<Symbol> sentence;
+        std::uint64_t s = first;
+        for (std::size_t added = 0; s < header.sentences && added < max_symbols; ++s) {
+            unsigned count = counts != nullptr ? counts[s] : 1;
+            sentence.clear();
+            for (std::uint64_t i = offsets[s]; i < offsets[s + 1]; ++i) {
+                sentence.push_back(symbols[i] >= 0 && std::uint64_t(symbols[i]) < header.words ? translation[symbols[i]] : -1);
+                if (sentence.back() < 0) {
+                    break;
+                }
+            }
+            if (!sentence.empty() && sentence.back() < 0) {
+                ignored += count;
+            } else {
+                corpus.append(sentence.data(), sentence.size(), count);
+                added += sentence.size();
+            }
+        }
+        return s;
+    }
+
+    /// Gives the pages of the words of the sentences before the given one back to the system.
+    /// They are read from the file again, if they are needed later.
+    void release(std::uint64_t sentence) const {
+        const std::uint64_t * offsets = (const std::uint64_t*) (mapping + sentence_offsets_position());
+        std::uint64_t end = (symbols_position() + offsets[sentence] * sizeof(Symbol)) / page_size() * page_size();
+        if (end > 0) {
+            madvise(mapping, end, MADV_DONTNEED);
+        }
+    }
+
+    /// The number of distinct sentences in the file.
+    std::uint64_t no_of_sentences() const {
+        return header.sentences;
+    }
+
+    /*
+     * Tokenizes the text corpus like the EMTrainer (one sentence per line, the words are separated
+     * by blanks or tabs) and writes the distinct sentences to the file. Returns false, if the file
+     * could not be written.
+     */
+    static bool encode(std::istream& text, const std::string& file_path) {
+        typedef boost::char_separator<char> CharSeparator;
+        typedef boost::tokenizer<CharSeparator> Tokenizer;
+
+        ExtSignature vocabulary;
+        Corpus corpus;
+        std::vector<Symbol> sentence;
+        std::string line;
+        Header header{{}, version, byte_order_mark, 0, 0, 0, 0, 0, 0};
+        while (std::getline(text, line)) {
+            if (!line.empty()) {
+                ++header.lines;
+                sentence.clear();
+                Tokenizer tokens(line, CharSeparator("\t "));
+                for (const std::string& word : tokens) {
+                    sentence.push_back(vocabulary.add_symbol(word));
+                }
+                if (!sentence.empty()) {
+                    corpus.add(sentence);
+                }
+            }
+        }
+
+        header.words = vocabulary.size();
+        header.sentences = corpus.size();
+        header.symbols = corpus.no_of_symbols();
+        std::vector<std::uint64_t> word_offsets(1, 0);
+        std::string words;
+        for (unsigned w = 0; w < vocabulary.size(); ++w) {
+            words += vocabulary.resolve_id(w);
+            word_offsets.push_back(words.size());
+        }
+        std::vector<std::uint64_t> offsets(1, 0);
+        std::vector<std::uint32_t> counts;
+        for (unsigned s = 0; s < corpus.size(); ++s) {
+            offsets.push_back(offsets.back() + corpus.length(s));
+            counts.push_back(corpus.count(s));
+            header.has_counts = header.has_counts || corpus.count(s) != 1;
+        }
+        std::memcpy(header.magic, magic, magic_size);
+
+        std::ofstream file(file_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file) {
+            LOG(ERROR) << "EncodedCorpus: Cannot create the file '" << file_path << "'.";
+            return false;
+        }
+        std::uint64_t written = 0;
+        write_array(file, written, &header, 1);
+        write_array(file, written, word_offsets.data(), word_offsets.size());
+        write_array(file, written, words.data(), words.size());
+        write_array(file, written, offsets.data(), offsets.size());
+        write_array(file, written, corpus.empty() ? nullptr : corpus.words(0), corpus.no_of_symbols());
+        if (header.has_counts) {
+            write_array(file, written, counts.data(), counts.size());
+        }
+        if (!file) {
+            LOG(ERROR) << "EncodedCorpus: Cannot write the file '" << file_path << "'.";
+            return false;
+        }
+        PCFGEM_VLOG(2) << "EncodedCorpus: Wrote " << header.lines << " sentences (" << header.sentences << " distinct ones) with "
+                << header.words << " different words to '" << file_path << "'.";
+        return true;
+    }
+
+private:
+    struct Header {
+        char            magic[8];
+        std::uint32_t   version;
+        std::uint32_t   byte_order_mark;
+        std::uint64_t   lines;
+        std::uint64_t   words;
+        std::uint64_t   sentences;
+        std::uint64_t   symbols;
+        std::uint32_t   has_counts;
+        std::uint32_t   unused;
+    };
+
+    static constexpr const char * magic = "PCFGCRP1";
+    static const std::size_t magic_size = 8;
+    static const std::uint32_t byte_order_mark = 0x01020304;
+    static const std::uint64_t alignment = 8;
+
+    static std::uint64_t aligned(std::uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    /// Writes the values and pads the file to the alignment.
+    template <typename Value>
+    static void write_array(std::ofstream& file, std::uint64_t& written, const Value * values, std::size_t no_of_values) {
+        static const char zeros[alignment] = {};
+        file.write((const char*) values, no_of_values * sizeof(Value));
+        std::uint64_t end = written + no_of_values * sizeof(Value);
+        file.write(zeros, aligned(end) - end);
+        written = aligned(end);
+    }
+
+    // The positions of the arrays follow from the header.
+    std::uint64_t word_offsets_position() const {
+        return aligned(sizeof(Header));
+    }
+
+    std::uint64_t words_position() const {
+        return word_offsets_position() + aligned((header.words + 1) * sizeof(std::uint64_t));
+    }
+
+    std::uint64_t sentence_offsets_position() const {
+        return words_position() + aligned(word_offsets()[header.words]);
+    }
+
+    std::uint64_t symbols_position() const {
+        return sentence_offsets_position() + aligned((header.sentences + 1) * sizeof(std::uint64_t));
+    }
+
+    std::uint64_t counts_position() const {
+        return symbols_position() + aligned(header.symbols * sizeof(Symbol));
+    }
+
+    std::uint64_t end_position() const {
+        return header.has_counts ? counts_position() + aligned(header.sentences * sizeof(std::uint32_t)) : counts_position();
+    }
+
+    static std::uint64_t page_size() {
+        return sysconf(_SC_PAGESIZE);
+    }
+
+    const std::uint64_t * word_offsets() const {
+        return (const std::uint64_t*) (mapping + word_offsets_position());
+    }
+
+    /// Maps the file and checks its header and its size.
+    void map_file() {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0) {
+            LOG(ERROR) << "EncodedCorpus: Cannot open the file '" << path << "'.";
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        mapping_size = status.st_size;
+        if (mapping_size < sizeof(Header)) {
+            LOG(ERROR) << "EncodedCorpus: The file '" << path << "' is too short for an encoded corpus.";
+            close(fd);
+            return;
+        }
+        void * address = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            LOG(ERROR) << "EncodedCorpus: Cannot map the file '" << path << "'.";
+            return;
+        }
+        mapping = (unsigned char*) address;
+        madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, magic, magic_size) != 0 || header.byte_order_mark != byte_order_mark || header.version != version) {
+            LOG(ERROR) << "EncodedCorpus: The file '" << path << "' is not an encoded corpus of this version and machine. Please encode the corpus again.";
+            unmap();
+            return;
+        }
+        // Each count is compared with the size of the file before it is multiplied, so the positions cannot overflow.
+        if (header.words >= mapping_size / sizeof(std::uint64_t) || header.sentences >= mapping_size / sizeof(std::uint64_t)
+                || header.symbols > mapping_size / sizeof(Symbol)
+                || words_position() > mapping_size || word_offsets()[header.words] > mapping_size
+                || sentence_offsets_position() > mapping_size || end_position() != mapping_size
+                || !is_monotonic(word_offsets(), header.words, word_offsets()[header.words], false)
+                || !is_monotonic((const std::uint64_t*) (mapping + sentence_offsets_position()), header.sentences, header.symbols, true)) {
+            LOG(ERROR) << "EncodedCorpus: The file '" << path << "' is corrupt.";
+            unmap();
+        }
+    }
+
+    /// True, if the offsets [0, count] do not decrease and end at most at the given limit. If strict is
+    /// set, they must grow: encode() never writes an empty sentence, and the trainer cannot parse one.
+    static bool is_monotonic(const std::uint64_t * offsets, std::uint64_t count, std::uint64_t limit, bool strict) {
+        for (std::uint64_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1] || (strict && offsets[i] == offsets[i + 1])) {
+                return false;
+            }
+        }
+        return offsets[count] <= limit;
+    }
+
+    void unmap() {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+
+private:
+    std::string         path;
+    unsigned char *     mapping;
+    std::uint64_t       mapping_size;
+    Header              header;
+};
+
+#endif	/* ENCODEDCORPUS_HPP */
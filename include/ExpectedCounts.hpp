@@ -0,0 +1,84 @@
+/*
+ * File:   ExpectedCounts.hpp
+ * Author: Johannes Gontrum
+ *
+ * Expected counts of rules and nonterminals for the E-step of the EM training.
+ */
+
+#ifndef EXPECTEDCOUNTS_HPP
+#define	EXPECTEDCOUNTS_HPP
+
+#include <vector>
+#include <cassert>
+
+/// Sums up how many times each rule and each nonterminal is expected to be used in the derivations of the sentences.
+/// Rules and nonterminals are identified by their dense IDs in the grammar, so all counts are stored in flat arrays.
+class ExpectedCounts {
+public:
+    typedef double                          Probability;
+    typedef std::vector<Probability>        ProbabilityVector;
+
+public:
+    ExpectedCounts() : weight(1) {
+    }
+
+    ExpectedCounts(unsigned no_of_rules, unsigned no_of_nonterminals)
+    :
+    rule_counts(no_of_rules, 0),
+    symbol_counts(no_of_nonterminals, 0),
+    weight(1) {
+    }
+
+    /// Sets all counts to 0 and adapts the size of the arrays. The memory is reused, as long as the grammar does not grow.
+    void reset(unsigned no_of_rules, unsigned no_of_nonterminals) {
+        rule_counts.assign(no_of_rules, 0);
+        symbol_counts.assign(no_of_nonterminals, 0);
+    }
+
+    /// All values that are added from now on are multiplied with the weight, e.g. the number of times
+    /// a sentence occurs in the corpus. Default: 1
+    void set_weight(Probability new_weight) {
+        weight = new_weight;
+    }
+
+    /// Adds the expectation for the rule with the given dense ID.
+    inline void add_rule(unsigned rule, Probability value) {
+        rule_counts[rule] += weight * value;
+    }
+
+    /// Adds the expectation for the nonterminal with the given dense ID.
+    inline void add_symbol(unsigned nt, Probability value) {
+        symbol_counts[nt] += weight * value;
+    }
+
+    /// Adds all counts of another object with the same size, e.g. the counts of another thread.
+    void add(const ExpectedCounts& other) {
+        assert(other.rule_counts.size() == rule_counts.size() && other.symbol_counts.size() == symbol_counts.size());
+        add(other.rule_counts.data(), other.symbol_counts.data());
+    }
+
+    /// Adds counts from arrays with one value per rule and per nonterminal.
+    void add(const Probability * other_rule_counts, const Probability * other_symbol_counts) {
+        for (unsigned r = 0; r < rule_counts.size(); ++r) {
+            rule_counts[r] += weight * other_rule_counts[r];
+        }
+        for (unsigned nt = 0; nt < symbol_counts.size(); ++nt) {
+            symbol_counts[nt] += weight * other_symbol_counts[nt];
+        }
+    }
+
+    inline const Probability& get_rule_count(unsigned rule) const {
+        return rule_counts[rule];
+    }
+
+    inline const Probability& get_symbol_count(unsigned nt) const {
+        return symbol_counts[nt];
+    }
+
+private:
+    ProbabilityVector rule_counts; ///< Expectation per rule
+    ProbabilityVector symbol_counts; ///< Expectation per nonterminal
+    Probability weight; ///< Factor for all added values
+};
+
+#endif	/* EXPECTEDCOUNTS_HPP */
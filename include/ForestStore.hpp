@@ -0,0 +1,280 @@
+/*
+ * File:   ForestStore.hpp
+ * Author: Johannes Gontrum
+ *
+ * Keeps the parse forests of a corpus in a memory mapped file, so they do not have to fit into memory.
+ */
+
+#ifndef FORESTSTORE_HPP
+#define	FORESTSTORE_HPP
+
+#include "ParseForest.hpp"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <future>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Tracing.hpp"
+
+/*
+ * The forests are written once, in the order of the sentences, and then read many times.
+ * They are grouped into shards: A shard is closed, as soon as its decoded forests would need
+ * more than half of the memory budget. While the trainer estimates the sentences of one
+ * shard, the next one is decoded in the background, so at most two shards are in memory.
+ *
+ * File format (numbers in the byte order of the machine, the file is only a temporary cache):
+ *   "PCFGFST1"
+ *   shards:   per forest: uint32 sentence index, ParseForest::encode()
+ *   index:    per shard: uint64 offset, uint64 size in bytes, uint32 forests, uint64 decoded bytes
+ *   trailer:  uint64 offset of the index, uint32 number of shards, "PCFGFST1"
+ *
+ * The file is deleted together with the store.
+ */
+class ForestStore {
+public:
+    /// The decoded forests of one shard.
+    struct Shard {
+        std::vector<unsigned>       sentences;  ///< Index of the sentence of each forest
+        std::vector<ParseForest>    forests;
+    };
+
+private:
+    struct ShardInfo {
+        std::uint64_t   offset;         ///< Position of the first forest in the file
+        std::uint64_t   size;           ///< Encoded size in bytes
+        std::uint32_t   no_of_forests;
+        std::uint64_t   decoded_bytes;  ///< Memory of the decoded forests
+    };
+
+    typedef std::vector<unsigned char>  ByteVector;
+    typedef std::vector<ShardInfo>      ShardVector;
+
+public:
+    /// Creates the file. Check is_open() afterwards.
+    ForestStore(const std::string& file_path, std::size_t budget)
+    :
+    path(file_path),
+    memory_budget(budget),
+    file(file_path, std::ios::out | std::ios::binary | std::ios::trunc),
+    written(0),
+    mapping(nullptr),
+    mapping_size(0) {
+        if (!file) {
+            LOG(ERROR) << "ForestStore: Cannot create the file '" << path << "'.";
+            return;
+        }
+        write_bytes(magic, magic_size);
+        start_shard();
+    }
+
+    ~ForestStore() {
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+        if (file.is_open()) {
+            file.close();
+        }
+        std::remove(path.c_str());
+    }
+
+    ForestStore(const ForestStore&) = delete;
+    ForestStore& operator=(const ForestStore&) = delete;
+
+    bool is_open() const {
+        return mapping != nullptr || (file.is_open() && file.good());
+    }
+
+    /// Half of the budget: the memory of one decoded shard.
+    std::size_t shard_budget() const {
+        return memory_budget / 2;
+    }
+
+    /// Appends the forest of a sentence. Only possible before finish().
+    void add(unsigned sentence, const ParseForest& forest) {
+        std::size_t decoded = forest.memory_usage() + sizeof(ParseForest) + sizeof(unsigned);
+        ShardInfo& shard = shards.back();
+        if (shard.no_of_forests > 0 && shard.decoded_bytes + decoded > shard_budget()) {
+            flush_shard();
+            start_shard();
+        }
+        if (decoded > shard_budget()) {
+            LOG(WARNING) << "ForestStore: The forest of sentence " << sentence << " alone needs " << decoded / 1024
+                    << " KiB, more than half of the memory budget.";
+        }
+
+        std::uint32_t index = sentence;
+        buffer.insert(buffer.end(), (const unsigned char*) &index, (const unsigned char*) &index + sizeof(index));
+        forest.encode(buffer);
+        ++shards.back().no_of_forests;
+        shards.back().decoded_bytes += decoded;
+    }
+
+    /// Writes the index, closes the file and maps it into memory. Returns false on errors.
+    bool finish() {
+        flush_shard();
+        if (shards.back().no_of_forests == 0) {
+            shards.pop_back();
+        }
+
+        std::uint64_t index_offset = written;
+        for (const ShardInfo& shard : shards) {
+            write_value(shard.offset);
+            write_value(shard.size);
+            write_value(shard.no_of_forests);
+            write_value(shard.decoded_bytes);
+        }
+        write_value(index_offset);
+        write_value(std::uint32_t(shards.size()));
+        write_bytes(magic, magic_size);
+        file.close();
+        if (!file) {
+            LOG(ERROR) << "ForestStore: Cannot write the file '" << path << "'.";
+            return false;
+        }
+        return map_file();
+    }
+
+    unsigned no_of_shards() const {
+        return shards.size();
+    }
+
+    /// Size of the file in bytes.
+    std::size_t file_size() const {
+        return written;
+    }
+
+    /*
+     * Calls function(const Shard&) for all shards in the order of the file. The next shard is
+     * decoded by another thread while the function runs.
+     */
+    template <typename Function>
+    void for_each_shard(Function function) const {
+        if (shards.empty()) {
+            return;
+        }
+        std::future<Shard> next = std::async(std::launch::async, &ForestStore::decode_shard, this, 0);
+        for (unsigned s = 0; s < shards.size(); ++s) {
+            Shard shard = next.get();
+            if (s + 1 < shards.size()) {
+                next = std::async(std::launch::async, &ForestStore::decode_shard, this, s + 1);
+            }
+            function(shard);
+        }
+    }
+
+private:
+    static constexpr const char * magic = "PCFGFST1";
+    static const std::size_t magic_size = 8;
+
+    void start_shard() {
+        shards.push_back(ShardInfo{written, 0, 0, 0});
+    }
+
+    void flush_shard() {
+        write_bytes(buffer.data(), buffer.size());
+        shards.back().size = buffer.size();
+        buffer.clear();
+    }
+
+    void write_bytes(const void * data, std::size_t size) {
+        file.write((const char*) data, size);
+        written += size;
+    }
+
+    template <typename Value>
+    void write_value(Value value) {
+        write_bytes(&value, sizeof(value));
+    }
+
+    template <typename Value>
+    static Value read_value(const unsigned char * data) {
+        Value value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    /// Maps the finished file and checks, that its index matches the shards that were written.
+    bool map_file() {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0 || std::uint64_t(status.st_size) != written) {
+            LOG(ERROR) << "ForestStore: Cannot open the file '" << path << "' again.";
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        mapping_size = status.st_size;
+        void * address = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            LOG(ERROR) << "ForestStore: Cannot map the file '" << path << "'.";
+            return false;
+        }
+        mapping = (unsigned char*) address;
+
+        const unsigned char * trailer = mapping + mapping_size - magic_size - sizeof(std::uint32_t) - sizeof(std::uint64_t);
+        std::uint64_t index_offset = read_value<std::uint64_t>(trailer);
+        std::uint32_t no_of_shards = read_value<std::uint32_t>(trailer + sizeof(std::uint64_t));
+        if (std::memcmp(mapping, magic, magic_size) != 0 || std::memcmp(mapping + mapping_size - magic_size, magic, magic_size) != 0
+                || no_of_shards != shards.size()) {
+            LOG(ERROR) << "ForestStore: The file '" << path << "' is corrupt.";
+            return false;
+        }
+        const unsigned char * entry = mapping + index_offset;
+        for (ShardInfo& shard : shards) {
+            shard.offset = read_value<std::uint64_t>(entry);
+            shard.size = read_value<std::uint64_t>(entry + 8);
+            shard.no_of_forests = read_value<std::uint32_t>(entry + 16);
+            shard.decoded_bytes = read_value<std::uint64_t>(entry + 20);
+            entry += 28;
+        }
+        PCFGEM_VLOG(2) << "ForestStore: Wrote " << shards.size() << " shards with " << written / 1024 << " KiB to '" << path << "'.";
+        return true;
+    }
+
+    /// Decodes one shard. The pages of the shard are requested before and released after decoding,
+    /// so the mapped file does not stay in the memory of the process.
+    Shard decode_shard(unsigned s) const {
+        const ShardInfo& info = shards[s];
+        long page = sysconf(_SC_PAGESIZE);
+        std::uint64_t first_page = info.offset / page * page;
+        unsigned char * region = mapping + first_page;
+        std::size_t region_size = info.offset + info.size - first_page;
+        madvise(region, region_size, MADV_WILLNEED);
+
+        Shard shard;
+        shard.sentences.resize(info.no_of_forests);
+        shard.forests.resize(info.no_of_forests);
+        const unsigned char * data = mapping + info.offset;
+        for (unsigned f = 0; f < info.no_of_forests; ++f) {
+            shard.sentences[f] = read_value<std::uint32_t>(data);
+            data = shard.forests[f].decode(data + sizeof(std::uint32_t));
+        }
+        assert(data == mapping + info.offset + info.size);
+
+        madvise(region, region_size, MADV_DONTNEED);
+        return shard;
+    }
+
+private:
+    std::string     path;           ///< Path of the file
+    std::size_t     memory_budget;  ///< Memory for two decoded shards
+    std::ofstream   file;           ///< The file while it is written
+    std::uint64_t   written;        ///< Bytes written so far
+    ByteVector      buffer;         ///< Encoded forests of the current shard
+    ShardVector     shards;         ///< All shards
+    unsigned char * mapping;        ///< The mapped file after finish()
+    std::size_t     mapping_size;   ///< Size of the mapping
+};
+
+#endif	/* FORESTSTORE_HPP */
@@ -0,0 +1,286 @@
+/*
+ * File:   GrammarImage.hpp
+ * Author: Johannes Gontrum
+ *
+ * A compiled grammar in a binary file, which is memory mapped instead of parsed.
+ */
+
+#ifndef GRAMMARIMAGE_HPP
+#define	GRAMMARIMAGE_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Tracing.hpp"
+
+/*
+ * Reading a grammar in the text format tokenizes every line, converts the probabilities with
+ * lexical_cast, sorts the rules and builds the indexes. 'pcfgem compile' does all of that once
+ * and writes the result to an image, which ProbabilisticContextFreeGrammar can be constructed
+ * from: The signature, the rules and the rhs indexes are copied out of the mapping as they are.
+ *
+ * The image only consists of arrays, the sections. Each section starts at a multiple of 8 bytes,
+ * so its values can be read in place from the mapping (which is aligned to a page).
+ *
+ * File format (numbers in the byte order of the machine that compiled the grammar, an image from
+ * a machine with a different byte order is rejected by the byte order mark):
+ *   header:   "PCFGGRM1", uint32 version, uint32 byte order mark, int32 start symbol,
+ *             uint32 number of sections, per section: uint64 offset, uint64 number of values,
+ *             uint64 size of a value
+ *   sections: see SectionID
+ *
+ * The rules are stored in the order of the grammar (sorted by their lhs), a rule ID is the
+ * position of a rule. The rhs indexes are stored in compressed rows: The rule IDs for the symbol s
+ * are the values [offsets[s], offsets[s + 1]) of the rule list, in the order of the grammar.
+ */
+class GrammarImage {
+public:
+    enum SectionID {
+        STRING_OFFSETS,     ///< uint64: Symbol ID -> begin of its name in STRINGS (one more value for the end)
+        STRINGS,            ///< char: The names of all symbols, one after another
+        RULES,              ///< RuleRecord
+        RHS_SYMBOLS,        ///< int32: The rhs of all rules, one after another
+        PROBABILITIES,      ///< double: Rule ID -> probability
+        FIRST_OFFSETS,      ///< uint32: Symbol ID -> begin of its rules in FIRST_RULES
+        FIRST_RULES,        ///< uint32: Binary rules by the first symbol of their rhs
+        SECOND_OFFSETS,     ///< uint32: Symbol ID -> begin of its rules in SECOND_RULES
+        SECOND_RULES,       ///< uint32: Binary rules by the second symbol of their rhs
+        TERMINAL_OFFSETS,   ///< uint32: Symbol ID -> begin of its rules in TERMINAL_RULES
+        TERMINAL_RULES,     ///< uint32: Unary rules by their terminal
+        NO_OF_SECTIONS
+    };
+
+    struct RuleRecord {
+        std::int32_t    lhs;
+        std::uint32_t   arity;
+        std::uint64_t   rhs_offset; ///< Position of the first rhs symbol in RHS_SYMBOLS
+    };
+
+    static const std::uint32_t version = 1;
+
+    /// Collects the sections of a new image and writes them to a file.
+    class Writer {
+    public:
+        Writer() : sections(NO_OF_SECTIONS) {
+        }
+
+        template <typename Value>
+        void set(SectionID id, const std::vector<Value>& values) {
+            Section& section = sections[id];
+            section.no_of_values = values.size();
+            section.value_size = sizeof(Value);
+            section.bytes.resize(values.size() * sizeof(Value));
+            if (!values.empty()) {
+                std::memcpy(section.bytes.data(), values.data(), section.bytes.size());
+            }
+        }
+
+        bool write(const std::string& path, std::int32_t start_symbol) const {
+            std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file) {
+                LOG(ERROR) << "GrammarImage: Cannot create the file '" << path << "'.";
+                return false;
+            }
+            std::vector<SectionInfo> infos(NO_OF_SECTIONS);
+            std::uint64_t offset = aligned(header_size());
+            for (unsigned s = 0; s < NO_OF_SECTIONS; ++s) {
+                infos[s] = SectionInfo{offset, sections[s].no_of_values, sections[s].value_size};
+                offset = aligned(offset + sections[s].bytes.size());
+            }
+
+            Header header{{}, version, byte_order_mark, start_symbol, NO_OF_SECTIONS};
+            std::memcpy(header.magic, magic, magic_size);
+            file.write((const char*) &header, sizeof(header));
+            file.write((const char*) infos.data(), infos.size() * sizeof(SectionInfo));
+            std::uint64_t written = header_size();
+            for (unsigned s = 0; s < NO_OF_SECTIONS; ++s) {
+                pad(file, written, infos[s].offset);
+                file.write((const char*) sections[s].bytes.data(), sections[s].bytes.size());
+                written += sections[s].bytes.size();
+            }
+            pad(file, written, offset);
+
+            if (!file) {
+                LOG(ERROR) << "GrammarImage: Cannot write the file '" << path << "'.";
+                return false;
+            }
+            PCFGEM_VLOG(2) << "GrammarImage: Wrote " << offset / 1024 << " KiB to '" << path << "'.";
+            return true;
+        }
+
+    private:
+        struct Section {
+            std::uint64_t               no_of_values = 0;
+            std::uint64_t               value_size = 0;
+            std::vector<char>           bytes;
+        };
+
+        static void pad(std::ofstream& file, std::uint64_t& written, std::uint64_t offset) {
+            static const char zeros[alignment] = {};
+            file.write(zeros, offset - written);
+            written = offset;
+        }
+
+        std::vector<Section> sections;
+    };
+
+public:
+    /// Maps the image. Check is_open() afterwards.
+    explicit GrammarImage(const std::string& file_path)
+    :
+    path(file_path),
+    mapping(nullptr),
+    mapping_size(0),
+    start(-1),
+    sections(NO_OF_SECTIONS) {
+        map_file();
+    }
+
+    ~GrammarImage() {
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    GrammarImage(const GrammarImage&) = delete;
+    GrammarImage& operator=(const GrammarImage&) = delete;
+
+    bool is_open() const {
+        return mapping != nullptr;
+    }
+
+    /// True, if the file at the given path starts like an image. Used to tell images and text grammars apart.
+    /// Only regular files are checked, reading from a pipe would consume its first bytes.
+    static bool is_image(const std::string& file_path) {
+        struct stat status;
+        if (stat(file_path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+            return false;
+        }
+        char buffer[magic_size];
+        std::ifstream file(file_path, std::ios::in | std::ios::binary);
+        return file.read(buffer, magic_size) && std::memcmp(buffer, magic, magic_size) == 0;
+    }
+
+    std::int32_t start_symbol() const {
+        return start;
+    }
+
+    /// The values of a section, which are valid as long as the image. Returns nullptr (and logs
+    /// the error), if the values of the section do not have the size of the requested type.
+    template <typename Value>
+    const Value* section(SectionID id) const {
+        if (sections[id].value_size != sizeof(Value)) {
+            LOG(ERROR) << "GrammarImage: The section " << id << " of '" << path << "' has values of " << sections[id].value_size
+                    << " bytes instead of " << sizeof(Value) << ".";
+            return nullptr;
+        }
+        return (const Value*) (mapping + sections[id].offset);
+    }
+
+    /// The number of values in a section.
+    std::size_t size(SectionID id) const {
+        return sections[id].no_of_values;
+    }
+
+private:
+    struct Header {
+        char            magic[8];
+        std::uint32_t   version;
+        std::uint32_t   byte_order_mark;
+        std::int32_t    start_symbol;
+        std::uint32_t   no_of_sections;
+    };
+
+    struct SectionInfo {
+        std::uint64_t   offset;
+        std::uint64_t   no_of_values;
+        std::uint64_t   value_size;
+    };
+
+    static constexpr const char * magic = "PCFGGRM1";
+    static const std::size_t magic_size = 8;
+    static const std::uint32_t byte_order_mark = 0x01020304;
+    static const std::uint64_t alignment = 8;
+
+    static std::uint64_t header_size() {
+        return sizeof(Header) + NO_OF_SECTIONS * sizeof(SectionInfo);
+    }
+
+    static std::uint64_t aligned(std::uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    /// Maps the file and checks its header and the bounds of all sections.
+    void map_file() {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0) {
+            LOG(ERROR) << "GrammarImage: Cannot open the file '" << path << "'.";
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        mapping_size = status.st_size;
+        if (mapping_size < header_size()) {
+            LOG(ERROR) << "GrammarImage: The file '" << path << "' is too short for a grammar image.";
+            close(fd);
+            return;
+        }
+        void * address = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            LOG(ERROR) << "GrammarImage: Cannot map the file '" << path << "'.";
+            return;
+        }
+        mapping = (unsigned char*) address;
+
+        Header header;
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, magic, magic_size) != 0 || header.byte_order_mark != byte_order_mark) {
+            LOG(ERROR) << "GrammarImage: The file '" << path << "' is not a grammar image of this machine.";
+            unmap();
+            return;
+        }
+        if (header.version != version || header.no_of_sections != NO_OF_SECTIONS) {
+            LOG(ERROR) << "GrammarImage: The file '" << path << "' has the version " << header.version
+                    << ", but this program reads version " << std::uint32_t(version) << ". Please compile the grammar again.";
+            unmap();
+            return;
+        }
+        start = header.start_symbol;
+        std::memcpy(sections.data(), mapping + sizeof(Header), NO_OF_SECTIONS * sizeof(SectionInfo));
+        for (const SectionInfo& section : sections) {
+            // Divide instead of multiplying the sizes, which could overflow in a corrupt header.
+            if (section.offset % alignment != 0 || section.offset > mapping_size || section.value_size == 0
+                    || section.no_of_values > (mapping_size - section.offset) / section.value_size) {
+                LOG(ERROR) << "GrammarImage: The file '" << path << "' is corrupt.";
+                unmap();
+                return;
+            }
+        }
+        PCFGEM_VLOG(2) << "GrammarImage: Mapped " << mapping_size / 1024 << " KiB from '" << path << "'.";
+    }
+
+    void unmap() {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+
+private:
+    std::string                 path;
+    unsigned char *             mapping;
+    std::uint64_t               mapping_size;
+    std::int32_t                start;          ///< The start symbol
+    std::vector<SectionInfo>    sections;
+};
+
+#endif	/* GRAMMARIMAGE_HPP */
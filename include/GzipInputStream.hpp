@@ -0,0 +1,267 @@
+/*
+ * File:   GzipInputStream.hpp
+ * Author: Johannes Gontrum
+ *
+ * An input stream that decompresses a gzip file on another thread.
+ */
+
+#ifndef GZIPINPUTSTREAM_HPP
+#define	GZIPINPUTSTREAM_HPP
+
+#include <istream>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "Tracing.hpp"
+
+/*
+ * The grammar and the corpus are read with std::getline from any std::istream. For a gzip
+ * file, this stream buffer hands out the decompressed data: A thread reads the compressed file
+ * and inflates it into chunks, which it puts into a queue of at most max_chunks chunks. The
+ * reading thread takes them from the queue, so the decompression of the next chunks overlaps
+ * with the tokenization of the current one. The memory of the used chunks is given back to the
+ * decompressing thread.
+ *
+ * Files with several gzip members (e.g. from 'cat a.gz b.gz') are read completely. Like 'gzip -d',
+ * zero bytes after a member are skipped, and other bytes that do not start a new member only end
+ * the stream with a warning. If a member is corrupt, the error is logged and the stream fails at
+ * that point: underflow() throws, so the std::istream sets its badbit. Readers check bad() after
+ * they are done, since the end of the data alone does not tell a truncated file from a complete one.
+ */
+class GzipStreamBuffer : public std::streambuf {
+public:
+    explicit GzipStreamBuffer(const std::string& file_path)
+    :
+    path(file_path),
+    file(file_path, std::ios::in | std::ios::binary),
+    finished(false),
+    stopped(false),
+    failed(false) {
+        if (file) {
+            worker = std::thread(&GzipStreamBuffer::decompress, this);
+        } else {
+            finished = true;
+            failed = true;
+        }
+    }
+
+    ~GzipStreamBuffer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    GzipStreamBuffer(const GzipStreamBuffer&) = delete;
+    GzipStreamBuffer& operator=(const GzipStreamBuffer&) = delete;
+
+    /// True, if the file could be opened. Whether it is corrupt is only known once it has been read.
+    bool is_open() const {
+        return worker.joinable();
+    }
+
+    /// True, if the file could not be opened or is corrupt.
+    bool has_failed() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed;
+    }
+
+protected:
+    /// Takes the next chunk from the queue, when the current one has been read.
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!current.empty()) {
+            free_chunks.push_back(std::move(current));
+            changed.notify_all();
+        }
+        changed.wait(lock, [this]() { return !ready_chunks.empty() || finished; });
+        if (ready_chunks.empty()) {
+            setg(nullptr, nullptr, nullptr);
+            if (failed) {
+                // The istream catches this and sets its badbit.
+                throw std::ios_base::failure("GzipInputStream: The file '" + path + "' could not be decompressed completely.");
+            }
+            return traits_type::eof();
+        }
+        current = std::move(ready_chunks.front());
+        ready_chunks.pop_front();
+        changed.notify_all();
+        setg(current.data(), current.data(), current.data() + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    typedef std::vector<char> Chunk;
+
+    /// The decompressing thread.
+    void decompress() {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        // 16 + MAX_WBITS: expect a gzip header
+        bool ok = inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK;
+        std::vector<char> input(input_size);
+        Chunk output = take_free_chunk();
+        bool member_ended = false;
+        bool trailing_garbage = false;
+
+        while (ok && !stopped_now()) {
+            if (stream.avail_in == 0) {
+                file.read(input.data(), input.size());
+                stream.next_in = (Bytef*) input.data();
+                stream.avail_in = file.gcount();
+                if (stream.avail_in == 0) {
+                    // The end of the file is only fine after the end of a gzip member.
+                    ok = member_ended;
+                    break;
+                }
+            }
+            if (member_ended) {
+                // Zero bytes after a member are padding (e.g. of a tape or a block device), which 'gzip -d' skips as well.
+                while (stream.avail_in > 0 && *stream.next_in == 0) {
+                    ++stream.next_in;
+                    --stream.avail_in;
+                }
+                if (stream.avail_in == 0) {
+                    continue;
+                }
+                if (*stream.next_in != 0x1f) {
+                    trailing_garbage = true;
+                    break;
+                }
+                // Another gzip member follows.
+                inflateReset(&stream);
+                member_ended = false;
+            }
+            std::size_t used = output.size();
+            output.resize(chunk_size);
+            stream.next_out = (Bytef*) output.data() + used;
+            stream.avail_out = chunk_size - used;
+            int result = inflate(&stream, Z_NO_FLUSH);
+            output.resize(chunk_size - stream.avail_out);
+            if (result == Z_STREAM_END) {
+                member_ended = true;
+            } else if (result != Z_OK && result != Z_BUF_ERROR) {
+                ok = false;
+            }
+            if (output.size() == chunk_size) {
+                put_ready_chunk(std::move(output));
+                output = take_free_chunk();
+            }
+        }
+        inflateEnd(&stream);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!output.empty()) {
+            ready_chunks.push_back(std::move(output));
+        }
+        if (!ok && !stopped) {
+            LOG(ERROR) << "GzipInputStream: The file '" << path << "' is not a valid gzip file or it is truncated, it is only read up to the error.";
+            failed = true;
+        }
+        if (trailing_garbage && !stopped) {
+            LOG(WARNING) << "GzipInputStream: The file '" << path << "' has trailing garbage after the last gzip member, which is ignored.";
+        }
+        finished = true;
+        changed.notify_all();
+    }
+
+    bool stopped_now() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stopped;
+    }
+
+    /// Waits, until there is room in the queue, and returns the memory of a used chunk (or a new one).
+    Chunk take_free_chunk() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return ready_chunks.size() < max_chunks || stopped; });
+        Chunk chunk;
+        if (!free_chunks.empty()) {
+            chunk = std::move(free_chunks.back());
+            free_chunks.pop_back();
+        }
+        chunk.clear();
+        chunk.reserve(chunk_size);
+        return chunk;
+    }
+
+    void put_ready_chunk(Chunk&& chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready_chunks.push_back(std::move(chunk));
+        changed.notify_all();
+    }
+
+private:
+    static const std::size_t input_size = 256 << 10;   ///< Compressed bytes per read
+    static const std::size_t chunk_size = 1 << 20;     ///< Decompressed bytes per chunk
+    static const std::size_t max_chunks = 4;           ///< Decompressed chunks that wait to be read
+
+    std::string                 path;
+    std::ifstream               file;
+    std::thread                 worker;
+    mutable std::mutex          mutex;
+    std::condition_variable     changed;
+    std::deque<Chunk>           ready_chunks;   ///< Decompressed, not yet read
+    std::vector<Chunk>          free_chunks;    ///< Read, their memory can be reused
+    Chunk                       current;        ///< The chunk that is read right now
+    bool                        finished;       ///< The decompressing thread is done
+    bool                        stopped;        ///< The stream is destroyed
+    bool                        failed;         ///< The file could not be read or is corrupt
+};
+
+/// An std::istream over a GzipStreamBuffer. bad() is set, if the file is corrupt or truncated.
+class GzipInputStream : public std::istream {
+public:
+    explicit GzipInputStream(const std::string& file_path)
+    :
+    std::istream(nullptr),
+    buffer(file_path) {
+        rdbuf(&buffer);
+        if (!buffer.is_open()) {
+            setstate(std::ios::failbit);
+        }
+    }
+
+    /// True, if the file starts with the magic bytes of gzip. Pipes are not checked (see GrammarImage::is_image).
+    static bool is_gzip(const std::string& file_path) {
+        struct stat status;
+        if (stat(file_path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+            return false;
+        }
+        unsigned char magic[2];
+        std::ifstream file(file_path, std::ios::in | std::ios::binary);
+        return file.read((char*) magic, 2) && magic[0] == 0x1f && magic[1] == 0x8b;
+    }
+
+    /// Opens a file for reading: a GzipInputStream for a gzip file, else an ifstream. Check the state of
+    /// the stream, and bad() after reading.
+    static std::unique_ptr<std::istream> open(const std::string& file_path) {
+        if (is_gzip(file_path)) {
+            return std::unique_ptr<std::istream>(new GzipInputStream(file_path));
+        }
+        return std::unique_ptr<std::istream>(new std::ifstream(file_path, std::ios::in));
+    }
+
+private:
+    GzipStreamBuffer buffer;
+};
+
+#endif	/* GZIPINPUTSTREAM_HPP */
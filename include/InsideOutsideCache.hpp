@@ -10,32 +10,37 @@
 
 #include "ProbabilisticContextFreeGrammar.hpp"
 #include "PCFGRule.hpp"
+#include "InsideOutsideStorage.hpp"
 
 #include <vector>
-#include <unordered_map>
 #include <limits>       // std::numeric_limits
 #include <cstdint>
-#include <bitset>
 
 #include "easylogging++.h"
 
-/// Caches inside and outside values.
+/// Caches inside and outside values. Both values of a (Symbol, begin, end) triple are kept together in one slot
+/// of the storage policy (see InsideOutsideStorage.hpp). The default is a flat hash table, which is sized for
+/// all triples of the sentence in advance.
+template <typename Storage = FlatMapStorage>
 class InsideOutsideCache {
 public:
     typedef ProbabilisticContextFreeGrammar::Symbol     Symbol;
-    typedef uint8_t                                     LengthType;
+    typedef CacheKey::LengthType                        LengthType;
     typedef double                                      InsideOutsideProbability;
         
         
 private:
-    typedef ProbabilisticContextFreeGrammar::LHSRange                 PCFGRange;
-    typedef ProbabilisticContextFreeGrammar::const_iterator           PCFGCIt;
-    typedef uint64_t                                                  CachedItem;
-    typedef std::unordered_map<CachedItem, InsideOutsideProbability>  CacheMap;
+    typedef typename Storage::Slot                      CacheSlot;
     
     
 public:    
-    InsideOutsideCache(ProbabilisticContextFreeGrammar& pcfg) : grammar(pcfg) {
+    /// Creates a cache for a sentence of the given length. The recursive calculator visits about
+    /// every nonterminal for every span, so the storage may reserve this number of slots.
+    /// If an arena is given, the storage may take its memory from there.
+    InsideOutsideCache(ProbabilisticContextFreeGrammar& pcfg, unsigned sentence_length = 0, ChartArena * arena = nullptr)
+    :
+    grammar(pcfg),
+    cache(pcfg, sentence_length, arena) {
         assert(std::numeric_limits<Symbol>::max() <= UINT32_MAX); 
         // check, that the datatype that is used for symbols is not bigger than 32bit (eventhough it could be a 48bit type). 
         // This is needed for fast caching of <Symbol, Begin, End> and <Symbol, Length> Typles
@@ -44,70 +49,49 @@ public:
     const ProbabilisticContextFreeGrammar& get_grammar() {
         return grammar;
     }
+
+    /// The length of the longest sentence, whose positions can be stored in a key.
+    static unsigned max_sentence_length() {
+        return std::numeric_limits<LengthType>::max();
+    }
+
+    /// Memory of the storage in bytes.
+    std::size_t memory_usage() const {
+        return cache.memory_usage();
+    }
    
     /// returns the inside probability or a nullpointer.
     inline const InsideOutsideProbability* const get_inside_cache(const Symbol& symbol, const LengthType& begin, const LengthType& end) const {
-        CachedItem key = create_key(symbol, begin, end);
-        CacheMap::const_iterator cit = inside_cache.find(key);
-        return cit != inside_cache.end() ? &(cit->second) : nullptr;
+        const CacheSlot * slot = cache.find(symbol, begin, end);
+        return slot != nullptr && slot->inside >= 0 ? &(slot->inside) : nullptr;
     }
     
     /// returns the outside probability or a nullpointer.
     inline const InsideOutsideProbability* const get_outside_cache(const Symbol& symbol, const LengthType& begin, const LengthType& end) const {
-        CachedItem key = create_key(symbol, begin, end);
-        CacheMap::const_iterator cit = outside_cache.find(key);
-        return cit != outside_cache.end() ? &(cit->second) : nullptr;
+        const CacheSlot * slot = cache.find(symbol, begin, end);
+        return slot != nullptr && slot->outside >= 0 ? &(slot->outside) : nullptr;
     }
 
     /// saves a calculated inside probability
     inline void store_inside_cache(const Symbol& symbol, const LengthType& begin, const LengthType& end, const InsideOutsideProbability& value) {
-        inside_cache[create_key(symbol, begin, end)] = value;
+        CacheSlot * slot = cache.insert(symbol, begin, end);
+        if (slot != nullptr) {
+            slot->inside = value;
+        }
     }
 
     /// saves a calculated outside probability
     inline void store_outside_cache(const Symbol& symbol, const LengthType& begin, const LengthType& end, const InsideOutsideProbability& value) {
-        outside_cache[create_key(symbol, begin, end)] = value;
-    }
-    
-private:
-    
-    CachedItem create_key(const Symbol& symbol, const LengthType& begin, const LengthType& end) const {
-        CachedItem buffer = symbol;     // assign the first 32bit in the buffer for the symbol
-        buffer = (buffer << 8) | begin; // Now push the next 8bits in
-        buffer = (buffer << 8) | end;   // and another 8bits.
-        VLOG(10) << "InsideOutsideCache: Converting <" << symbol << "," << (int)begin << "," << (int)end << "> to 64bit key: " << (std::bitset<64>) buffer;
-        return buffer;
-        
-        /* Example:
-         * Assuming that Symbol is a 32bit type and LengthType is 8bit. 
-         * For a better visualisation let's also assume, that the value of 'symbol'
-         * is '4294967295' - the maximum number that a 32bit type can store. 
-         * Let's assign the value '0' to 'begin' and '255' to end;
-         * In binary, the variables would look like this:
-         * symbol = 11111111111111111111111111111111
-         * begin  = 00000000
-         * end    = 11111111
-         * 
-         * In the first step, all 32 bits of 'symbol' are copied to the buffer. 
-         * The buffer now has the value: 
-         * 0000000000000000000000000000000011111111111111111111111111111111
-         * After this, 'begin' is 'attached' to the buffer:
-         * 0000000000000000000000001111111111111111111111111111111100000000
-         * And now, 'end':
-         * 0000000000000000111111111111111111111111111111110000000011111111
-         * 
-         * In this way, it is possible to create a unique, hash-like value that can
-         * be used as a key in a map to find the already calculated inside probability
-         * for the symbol, begin and end. 
-         */
+        CacheSlot * slot = cache.insert(symbol, begin, end);
+        if (slot != nullptr) {
+            slot->outside = value;
+        }
     }
-
     
 private:
     ProbabilisticContextFreeGrammar& grammar;
 
-    CacheMap inside_cache;
-    CacheMap outside_cache;
+    Storage cache; ///< inside and outside values of each triple
     
 };
 
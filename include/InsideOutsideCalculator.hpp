@@ -17,14 +17,17 @@
 #include <string>
 #include <cassert>
 
-#include "easylogging++.h"
+#include "Tracing.hpp"
 
-/// Calculates inside and outside values for a sentence.
+/// Calculates inside and outside values for a sentence. The values are kept in an InsideOutsideCache
+/// with the same storage policy.
+template <typename Storage = FlatMapStorage>
 class InsideOutsideCalculator {
 public:
-    typedef InsideOutsideCache::InsideOutsideProbability        InsideOutsideProbability;
+    typedef InsideOutsideCache<Storage>                         Cache;
+    typedef typename Cache::InsideOutsideProbability            InsideOutsideProbability;
     typedef ProbabilisticContextFreeGrammar::Symbol             Symbol;
-    typedef InsideOutsideCache::LengthType                      LengthType;
+    typedef typename Cache::LengthType                          LengthType;
 
  
 private:
@@ -35,7 +38,7 @@ private:
     typedef ProbabilisticContextFreeGrammar::const_iterator     PCFGCIt;
     
 public:
-    InsideOutsideCalculator(InsideOutsideCache& iocache, const SymbolVector * sentence)
+    InsideOutsideCalculator(Cache& iocache, const SymbolVector * sentence)
     :
     grammar(iocache.get_grammar()),
     signature(iocache.get_grammar().get_signature()),
@@ -51,7 +54,7 @@ public:
      *  for further details about this implementation.
     */ 
     InsideOutsideProbability calculate_inside(const Symbol& symbol, const LengthType& begin, const LengthType& end) {
-        VLOG(7) << "InsideOutsideCalculator: Calculating Inside Probability: '" << signature.resolve_id(symbol) << "'(" << (unsigned)begin << ", " << (unsigned)end << ")";
+        PCFGEM_VLOG(7) << "InsideOutsideCalculator: Calculating Inside Probability: '" << signature.resolve_id(symbol) << "'(" << (unsigned)begin << ", " << (unsigned)end << ")";
 
         assert(begin <= end);
         assert(begin < sentence_len);
@@ -61,29 +64,30 @@ public:
         // First, check if we have already calculated this value
         const InsideOutsideProbability * const cached_prob = cache.get_inside_cache(symbol, begin, end);
         if (cached_prob != nullptr) {
-            VLOG(8) << "InsideOutsideCalculator: Using cached Inside Probability (" << *cached_prob << ") for '" << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
+            PCFGEM_VLOG(8) << "InsideOutsideCalculator: Using cached Inside Probability (" << *cached_prob << ") for '" << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
 
             return *cached_prob;
         }
 
-        PCFGRange rule_range = grammar.rules_for(symbol);
-
-        
         // Base case: The length of the span is 0
         if (begin == end) {
             // Check, that this is a valid request
             if (begin < sentence_len) {
                 Symbol terminal_symbol = (*input)[begin];
-                for (PCFGCIt rule = rule_range.first; rule != rule_range.second; ++rule) {
-                    if ((*rule)[0] == terminal_symbol && rule->arity() == 1) {
-                        VLOG(8) << "InsideOutsideCalculator: Inside Probability: is '" << rule->get_prob() << "' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
-
-                        cache.store_inside_cache(symbol, begin, end, rule->get_prob());
-                        return rule->get_prob();
+                // Use the lexicon: only the (few) preterminal rules for this word have to be checked.
+                const RulePointerVector * rules = grammar.get_rules_for_terminal(terminal_symbol);
+                if (rules != nullptr) {
+                    for (RulePointerVector::const_iterator rule = rules->begin(); rule != rules->end(); ++rule) {
+                        if ((*rule)->get_lhs() == symbol) {
+                            PCFGEM_VLOG(8) << "InsideOutsideCalculator: Inside Probability: is '" << (*rule)->get_prob() << "' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
+
+                            cache.store_inside_cache(symbol, begin, end, (*rule)->get_prob());
+                            return (*rule)->get_prob();
+                        }
                     }
                 }
             } else {
-                VLOG(8) << "InsideOutsideCalculator: Inside Probability: is '0' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
+                PCFGEM_VLOG(8) << "InsideOutsideCalculator: Inside Probability: is '0' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
 
                 cache.store_inside_cache(symbol, begin, end, 0);
                 return 0;
@@ -91,6 +95,7 @@ public:
         }
 
         // Inductive case:
+        PCFGRange rule_range = grammar.rules_for(symbol);
         InsideOutsideProbability score = 0;
         // Iterate over all rules with two NTs on the rhs.
         for (PCFGCIt rule = rule_range.first; rule != rule_range.second; ++rule) {
@@ -107,7 +112,7 @@ public:
                 }
             }
         }
-        VLOG(7) << "InsideOutsideCalculator: Inside Probability: is '" << score << "' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
+        PCFGEM_VLOG(7) << "InsideOutsideCalculator: Inside Probability: is '" << score << "' for " << signature.resolve_id(symbol) << "'(" << (unsigned) begin << ", " << (unsigned) end << ")";
 
         cache.store_inside_cache(symbol, begin, end, score);
         return score;
@@ -120,7 +125,7 @@ public:
      *  for further details about this implementation.
      */ 
     InsideOutsideProbability calculate_outside(const Symbol& symbol, const LengthType& left, const LengthType& right) {
-        VLOG(7) << "InsideOutsideCalculator: Calculating Outside Probability: '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+        PCFGEM_VLOG(7) << "InsideOutsideCalculator: Calculating Outside Probability: '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
         assert(left <= right);
         assert(left < sentence_len);
@@ -129,7 +134,7 @@ public:
         // Check the cache first
         const InsideOutsideProbability * const cached_prob = cache.get_outside_cache(symbol, left, right);
         if (cached_prob != nullptr) {
-            VLOG(8) << "InsideOutsideCalculator: Using cached Outside Probability (" << *cached_prob << ") for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+            PCFGEM_VLOG(8) << "InsideOutsideCalculator: Using cached Outside Probability (" << *cached_prob << ") for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
             return *cached_prob;
         }
 
@@ -137,12 +142,12 @@ public:
         if (left == 0 && right == sentence_len - 1) {
             // If the symbol is the start symbol, it covers the whole sentence, so we return 1
             if (grammar.get_start_symbol() == symbol) {
-                VLOG(8) << "InsideOutsideCalculator: Outside probability  is '1' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+                PCFGEM_VLOG(8) << "InsideOutsideCalculator: Outside probability  is '1' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
                 cache.store_outside_cache(symbol, left, right, 1);
                 return 1;
             } else { // If not, this case is not possible and we return 0
-                VLOG(8) << "InsideOutsideCalculator: Outside probability  is '0' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+                PCFGEM_VLOG(8) << "InsideOutsideCalculator: Outside probability  is '0' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
                 cache.store_outside_cache(symbol, left, right, 0);
                 return 0;
@@ -160,7 +165,7 @@ public:
             for (RulePointerVector::const_iterator rule = rules->begin();
                     rule != rules->end();
                     ++rule) {
-                VLOG(8) << "InsideOutsideCalculator: Current rule: '" << **rule << "' with '" << signature.resolve_id(symbol) << "' as first symbol on the rhs.'";
+                PCFGEM_VLOG(8) << "InsideOutsideCalculator: Current rule: '" << **rule << "' with '" << signature.resolve_id(symbol) << "' as first symbol on the rhs.'";
 
                 assert((*rule)->arity() == 2);
 
@@ -174,11 +179,11 @@ public:
                 }
             }
         } else {
-            VLOG(8) << "InsideOutsideCalculator: No rule with '" << signature.resolve_id(symbol) << "' as first symbol on the rhs exists.'";
+            PCFGEM_VLOG(8) << "InsideOutsideCalculator: No rule with '" << signature.resolve_id(symbol) << "' as first symbol on the rhs exists.'";
         }
 
 
-        VLOG(8) << "InsideOutsideCalculator: Outside probability for the left child is '" << score_left << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+        PCFGEM_VLOG(8) << "InsideOutsideCalculator: Outside probability for the left child is '" << score_left << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
 
         // Case 2: 'symbol' is the right Symbol on the rhs of a rule.
@@ -189,7 +194,7 @@ public:
             for (RulePointerVector::const_iterator rule = rules->begin();
                     rule != rules->end();
                     ++rule) {
-                VLOG(8) << "InsideOutsideCalculator: Current rule: '" << **rule << "' with '" << signature.resolve_id(symbol) << "' as second symbol on the rhs.'";
+                PCFGEM_VLOG(8) << "InsideOutsideCalculator: Current rule: '" << **rule << "' with '" << signature.resolve_id(symbol) << "' as second symbol on the rhs.'";
 
                 assert((*rule)->arity() == 2);
                 // Iterate over all possible divisions
@@ -202,12 +207,12 @@ public:
                 }
             }
         } else {
-            VLOG(8) << "InsideOutsideCalculator: No rule with '" << signature.resolve_id(symbol) << "' as second symbol on the rhs exists.'";
+            PCFGEM_VLOG(8) << "InsideOutsideCalculator: No rule with '" << signature.resolve_id(symbol) << "' as second symbol on the rhs exists.'";
         }
 
-        VLOG(8) << "InsideOutsideCalculator: Outside probability for the right child is '" << score_right << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+        PCFGEM_VLOG(8) << "InsideOutsideCalculator: Outside probability for the right child is '" << score_right << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
-        VLOG(7) << "InsideOutsideCalculator: Outside probability  is '" << score_left + score_right << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
+        PCFGEM_VLOG(7) << "InsideOutsideCalculator: Outside probability  is '" << score_left + score_right << "' for '" << signature.resolve_id(symbol) << "'(" << (unsigned) left << ", " << (unsigned) right << ")";
 
         cache.store_outside_cache(symbol, left, right, score_left + score_right);
 
@@ -220,7 +225,7 @@ private:
     const ProbabilisticContextFreeGrammar::ExtSignature&          signature;    ///< Signarue for prettier verbose messages
     const SymbolVector *                                         input;        ///< The current sentence
     LengthType                                                    sentence_len; ///< The length of the current sentence
-    InsideOutsideCache&                                           cache;        ///< A cache to store all calculated values
+    Cache&                                                        cache;        ///< A cache to store all calculated values
 };
 
 #endif	/* INSIDEOUTSIDECALCULATOR_HPP */
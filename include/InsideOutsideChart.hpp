@@ -0,0 +1,202 @@
+/*
+ * File:   InsideOutsideChart.hpp
+ * Author: Johannes Gontrum
+ *
+ * Dense chart of inside and outside values for the bottom-up calculator.
+ */
+
+#ifndef INSIDEOUTSIDECHART_HPP
+#define	INSIDEOUTSIDECHART_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+#include "ChartArena.hpp"
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+/*
+ * Stores inside and outside values for all (nonterminal, begin, end) triples of a sentence.
+ *
+ * Each value is kept in two orientations: In rows by begin (all ends of a nonterminal and a
+ * begin position next to each other) and in rows by end (all begin positions for an end).
+ * This way, the values of the first child over all split points of a span and the values
+ * of the second child over the same split points are both contiguous, which is what the
+ * vectorised kernels of the InsideOutsideKernel need.
+ * The outside values are accumulated in both orientations separately (the first child
+ * receives its mass in the row by begin, the second child in the row by end), the
+ * outside value of an item is the sum of both.
+ *
+ * Only the spans with begin <= end exist, so the rows are packed into a triangle per
+ * nonterminal: The row by begin b holds the ends b..n-1, the row by end e holds the
+ * begins 0..e. A chart for n words and N nonterminals therefore needs 4 * N * n(n+1)/2
+ * values instead of 4 * N * n * n. All offsets are std::size_t, so there is no limit on the
+ * length of a sentence other than the memory.
+ *
+ * For every row, the chart also remembers the first and the last position with a nonzero
+ * inside value, so the calculator can restrict the kernels to the split points that matter.
+ *
+ * All arrays are taken from a ChartArena, so the memory of the charts of consecutive sentences
+ * is reused. The chart is only valid until the arena is reset.
+ */
+class InsideOutsideChart {
+public:
+    typedef ProbabilisticContextFreeGrammar::NonterminalID  NonterminalID;
+    typedef double                                          InsideOutsideProbability;
+
+public:
+    /// Creates a chart for a sentence of the given length in the arena, all values are initialised with 0.
+    InsideOutsideChart(unsigned sentence_length, unsigned no_of_nonterminals, ChartArena& arena)
+    :
+    sentence_len(sentence_length),
+    no_of_nts(no_of_nonterminals),
+    cells_per_nt(triangle_size(sentence_length)),
+    inside_by_begin(arena.allocate<InsideOutsideProbability>(cells_per_nt * no_of_nonterminals, 0)),
+    inside_by_end(arena.allocate<InsideOutsideProbability>(cells_per_nt * no_of_nonterminals, 0)),
+    outside_by_begin(arena.allocate<InsideOutsideProbability>(cells_per_nt * no_of_nonterminals, 0)),
+    outside_by_end(arena.allocate<InsideOutsideProbability>(cells_per_nt * no_of_nonterminals, 0)),
+    exponents(arena.allocate<int>(cells_per_nt, 0)),
+    first_end(arena.allocate<unsigned>(sentence_length * no_of_nonterminals, sentence_length)),
+    last_end(arena.allocate<unsigned>(sentence_length * no_of_nonterminals, 0)),
+    first_begin(arena.allocate<unsigned>(sentence_length * no_of_nonterminals, sentence_length)),
+    last_begin(arena.allocate<unsigned>(sentence_length * no_of_nonterminals, 0)) {
+    }
+
+    InsideOutsideChart(const InsideOutsideChart&) = delete;
+    InsideOutsideChart& operator=(const InsideOutsideChart&) = delete;
+
+    /// The number of values that a chart for the given sentence length and number of nonterminals stores.
+    static std::size_t no_of_values(unsigned sentence_length, unsigned no_of_nonterminals) {
+        return 4 * triangle_size(sentence_length) * no_of_nonterminals;
+    }
+
+    unsigned get_sentence_length() const {
+        return sentence_len;
+    }
+
+    unsigned get_no_of_nonterminals() const {
+        return no_of_nts;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Single values
+    //////////////////////////////////////////////////////////////////////////
+
+    inline InsideOutsideProbability inside(const NonterminalID& nt, unsigned begin, unsigned end) const {
+        return inside_by_begin[index_by_begin(nt, begin, end)];
+    }
+
+    /// Sets the inside value in both orientations. Each item may only be set once.
+    inline void set_inside(const NonterminalID& nt, unsigned begin, unsigned end, InsideOutsideProbability value) {
+        inside_by_begin[index_by_begin(nt, begin, end)] = value;
+        inside_by_end[index_by_end(nt, begin, end)] = value;
+        if (value != 0) {
+            unsigned row = row_index(nt, begin);
+            if (end < first_end[row]) first_end[row] = end;
+            if (end > last_end[row]) last_end[row] = end;
+            row = row_index(nt, end);
+            if (begin < first_begin[row]) first_begin[row] = begin;
+            if (begin > last_begin[row]) last_begin[row] = begin;
+        }
+    }
+
+    inline InsideOutsideProbability outside(const NonterminalID& nt, unsigned begin, unsigned end) const {
+        return outside_by_begin[index_by_begin(nt, begin, end)] + outside_by_end[index_by_end(nt, begin, end)];
+    }
+
+    inline void set_outside(const NonterminalID& nt, unsigned begin, unsigned end, InsideOutsideProbability value) {
+        outside_by_begin[index_by_begin(nt, begin, end)] = value;
+        outside_by_end[index_by_end(nt, begin, end)] = 0;
+    }
+
+    /// The inside values of all nonterminals for the span [begin, end] are stored divided by 2^exponent
+    /// (and the outside values multiplied by it, see ChartInsideOutsideCalculator). Always 0 without scaling.
+    inline int exponent(unsigned begin, unsigned end) const {
+        return exponents[index_by_begin(0, begin, end)];
+    }
+
+    inline void set_exponent(unsigned begin, unsigned end, int value) {
+        exponents[index_by_begin(0, begin, end)] = value;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Rows
+    //////////////////////////////////////////////////////////////////////////
+
+    /// Inside values of nt for the given begin, starting at the given end. The following values belong to end + 1, end + 2, ...
+    inline const InsideOutsideProbability* inside_row_by_begin(const NonterminalID& nt, unsigned begin, unsigned end) const {
+        return &inside_by_begin[index_by_begin(nt, begin, end)];
+    }
+
+    /// Inside values of nt for the given end, starting at the given begin. The following values belong to begin + 1, begin + 2, ...
+    inline const InsideOutsideProbability* inside_row_by_end(const NonterminalID& nt, unsigned end, unsigned begin) const {
+        return &inside_by_end[index_by_end(nt, begin, end)];
+    }
+
+    /// Outside mass that nt received as the first child of a rule, starting at the given end.
+    inline InsideOutsideProbability* outside_row_by_begin(const NonterminalID& nt, unsigned begin, unsigned end) {
+        return &outside_by_begin[index_by_begin(nt, begin, end)];
+    }
+
+    /// Outside mass that nt received as the second child of a rule, starting at the given begin.
+    inline InsideOutsideProbability* outside_row_by_end(const NonterminalID& nt, unsigned end, unsigned begin) {
+        return &outside_by_end[index_by_end(nt, begin, end)];
+    }
+
+    /// The first and the last end position with a nonzero inside value in a row by begin.
+    /// If there is none, the first position is larger than the last one.
+    inline unsigned first_nonzero_end(const NonterminalID& nt, unsigned begin) const {
+        return first_end[row_index(nt, begin)];
+    }
+
+    inline unsigned last_nonzero_end(const NonterminalID& nt, unsigned begin) const {
+        return last_end[row_index(nt, begin)];
+    }
+
+    /// The first and the last begin position with a nonzero inside value in a row by end.
+    inline unsigned first_nonzero_begin(const NonterminalID& nt, unsigned end) const {
+        return first_begin[row_index(nt, end)];
+    }
+
+    inline unsigned last_nonzero_begin(const NonterminalID& nt, unsigned end) const {
+        return last_begin[row_index(nt, end)];
+    }
+
+private:
+    static std::size_t triangle_size(unsigned sentence_length) {
+        return (std::size_t) sentence_length * (sentence_length + 1) / 2;
+    }
+
+    inline unsigned row_index(const NonterminalID& nt, unsigned position) const {
+        assert(nt >= 0 && (unsigned) nt < no_of_nts && position < sentence_len);
+        return nt * sentence_len + position;
+    }
+
+    /// The rows by begin have the lengths n, n-1, ..., 1, so the row for begin starts after begin * (2n - begin + 1) / 2 values.
+    inline std::size_t index_by_begin(const NonterminalID& nt, unsigned begin, unsigned end) const {
+        assert(nt >= 0 && (unsigned) nt < no_of_nts && begin <= end && end < sentence_len);
+        return nt * cells_per_nt + (std::size_t) begin * (2 * sentence_len - begin + 1) / 2 + (end - begin);
+    }
+
+    /// The rows by end have the lengths 1, 2, ..., n, so the row for end starts after end * (end + 1) / 2 values.
+    inline std::size_t index_by_end(const NonterminalID& nt, unsigned begin, unsigned end) const {
+        assert(nt >= 0 && (unsigned) nt < no_of_nts && begin <= end && end < sentence_len);
+        return nt * cells_per_nt + (std::size_t) end * (end + 1) / 2 + begin;
+    }
+
+private:
+    unsigned            sentence_len;       ///< The length of the sentence
+    unsigned            no_of_nts;          ///< Number of nonterminals
+    std::size_t         cells_per_nt;       ///< Number of spans, the size of the triangle of one nonterminal
+    InsideOutsideProbability *  inside_by_begin;    ///< Inside values, rows by (nonterminal, begin)
+    InsideOutsideProbability *  inside_by_end;      ///< Inside values, rows by (nonterminal, end)
+    InsideOutsideProbability *  outside_by_begin;   ///< Outside mass as first child, rows by (nonterminal, begin)
+    InsideOutsideProbability *  outside_by_end;     ///< Outside mass as second child, rows by (nonterminal, end)
+    int *                       exponents;          ///< Scaling exponent per span, rows by begin
+    unsigned *                  first_end;          ///< First nonzero end per row by begin
+    unsigned *                  last_end;           ///< Last nonzero end per row by begin
+    unsigned *                  first_begin;        ///< First nonzero begin per row by end
+    unsigned *                  last_begin;         ///< Last nonzero begin per row by end
+};
+
+#endif	/* INSIDEOUTSIDECHART_HPP */
@@ -0,0 +1,237 @@
+/*
+ * File:   InsideOutsideKernel.hpp
+ * Author: Johannes Gontrum
+ *
+ * Vectorised inner loops of the chart calculator with runtime dispatch.
+ */
+
+#ifndef INSIDEOUTSIDEKERNEL_HPP
+#define	INSIDEOUTSIDEKERNEL_HPP
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCFGEM_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ * The inner loop of both passes sums over the split points of a span. With the chart rows
+ * stored by begin and by end (see InsideOutsideChart), the values of both children are
+ * contiguous in memory for consecutive split points. Applying a rule A -> B C to the span
+ * [begin, end] is therefore
+ *  - a dot product of B's row and C's row for the inside value and the rule expectation,
+ *  - two scaled additions (axpy) to push the outside value of A to B and C.
+ *
+ * The kernels exist as scalar code and for SSE2, AVX2 (with FMA) and AVX-512. The best
+ * instruction set of the CPU is chosen at runtime, so the same binary runs everywhere.
+ */
+class InsideOutsideKernel {
+public:
+    enum InstructionSet {
+        SCALAR,
+        SSE2,
+        AVX2,
+        AVX512
+    };
+
+    typedef double (*DotFunction)(const double *, const double *, unsigned);
+    typedef void (*AxpyFunction)(double, const double *, double *, unsigned);
+
+public:
+    /// Uses the best instruction set that is supported by this CPU.
+    InsideOutsideKernel() {
+        select(best_instruction_set());
+    }
+
+    /// Uses the given instruction set, or the best supported one below it.
+    explicit InsideOutsideKernel(InstructionSet set) {
+        while (!is_supported(set)) {
+            set = InstructionSet(set - 1);
+        }
+        select(set);
+    }
+
+    /// Returns sum(a[i] * b[i]) for 0 <= i < n.
+    inline double dot(const double * a, const double * b, unsigned n) const {
+        return dot_function(a, b, n);
+    }
+
+    /// Adds alpha * x[i] to y[i] for 0 <= i < n.
+    inline void axpy(double alpha, const double * x, double * y, unsigned n) const {
+        axpy_function(alpha, x, y, n);
+    }
+
+    InstructionSet get_instruction_set() const {
+        return instruction_set;
+    }
+
+    static const char * name(InstructionSet set) {
+        switch (set) {
+            case SSE2:      return "sse2";
+            case AVX2:      return "avx2";
+            case AVX512:    return "avx512";
+            default:        return "scalar";
+        }
+    }
+
+    static bool is_supported(InstructionSet set) {
+#ifdef PCFGEM_X86_KERNELS
+        __builtin_cpu_init();
+        switch (set) {
+            case SSE2:      return __builtin_cpu_supports("sse2");
+            case AVX2:      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            case AVX512:    return __builtin_cpu_supports("avx512f");
+            default:        return true;
+        }
+#else
+        return set == SCALAR;
+#endif
+    }
+
+    static InstructionSet best_instruction_set() {
+        for (int set = AVX512; set > SCALAR; --set) {
+            if (is_supported(InstructionSet(set))) {
+                return InstructionSet(set);
+            }
+        }
+        return SCALAR;
+    }
+
+private:
+    void select(InstructionSet set) {
+        instruction_set = set;
+        switch (set) {
+#ifdef PCFGEM_X86_KERNELS
+            case SSE2:      dot_function = &dot_sse2;   axpy_function = &axpy_sse2;     break;
+            case AVX2:      dot_function = &dot_avx2;   axpy_function = &axpy_avx2;     break;
+            case AVX512:    dot_function = &dot_avx512; axpy_function = &axpy_avx512;   break;
+#endif
+            default:        dot_function = &dot_scalar; axpy_function = &axpy_scalar;   break;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Scalar
+    //////////////////////////////////////////////////////////////////////////
+
+    static double dot_scalar(const double * a, const double * b, unsigned n) {
+        double sum = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    static void axpy_scalar(double alpha, const double * x, double * y, unsigned n) {
+        for (unsigned i = 0; i < n; ++i) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+#ifdef PCFGEM_X86_KERNELS
+    //////////////////////////////////////////////////////////////////////////
+    // SSE2: 2 doubles per register
+    //////////////////////////////////////////////////////////////////////////
+
+    __attribute__((target("sse2")))
+    static double dot_sse2(const double * a, const double * b, unsigned n) {
+        __m128d sum = _mm_setzero_pd();
+        unsigned i = 0;
+        for (; i + 2 <= n; i += 2) {
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, sum);
+        double result = lanes[0] + lanes[1];
+        for (; i < n; ++i) {
+            result += a[i] * b[i];
+        }
+        return result;
+    }
+
+    __attribute__((target("sse2")))
+    static void axpy_sse2(double alpha, const double * x, double * y, unsigned n) {
+        __m128d factor = _mm_set1_pd(alpha);
+        unsigned i = 0;
+        for (; i + 2 <= n; i += 2) {
+            _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(factor, _mm_loadu_pd(x + i))));
+        }
+        for (; i < n; ++i) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // AVX2 + FMA: 4 doubles per register
+    //////////////////////////////////////////////////////////////////////////
+
+    __attribute__((target("avx2,fma")))
+    static double dot_avx2(const double * a, const double * b, unsigned n) {
+        __m256d sum = _mm256_setzero_pd();
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4) {
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), sum);
+        }
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        double lanes[2];
+        _mm_storeu_pd(lanes, half);
+        double result = lanes[0] + lanes[1];
+        for (; i < n; ++i) {
+            result += a[i] * b[i];
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void axpy_avx2(double alpha, const double * x, double * y, unsigned n) {
+        __m256d factor = _mm256_set1_pd(alpha);
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4) {
+            _mm256_storeu_pd(y + i, _mm256_fmadd_pd(factor, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        }
+        for (; i < n; ++i) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // AVX-512: 8 doubles per register, the remainder is handled with a mask
+    //////////////////////////////////////////////////////////////////////////
+
+    __attribute__((target("avx512f")))
+    static double dot_avx512(const double * a, const double * b, unsigned n) {
+        __m512d sum = _mm512_setzero_pd();
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum);
+        }
+        if (i < n) {
+            __mmask8 mask = (__mmask8) ((1u << (n - i)) - 1);
+            sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), sum);
+        }
+        double lanes[8];
+        _mm512_storeu_pd(lanes, sum);
+        return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    }
+
+    __attribute__((target("avx512f")))
+    static void axpy_avx512(double alpha, const double * x, double * y, unsigned n) {
+        __m512d factor = _mm512_set1_pd(alpha);
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+            _mm512_storeu_pd(y + i, _mm512_fmadd_pd(factor, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+        }
+        if (i < n) {
+            __mmask8 mask = (__mmask8) ((1u << (n - i)) - 1);
+            __m512d result = _mm512_fmadd_pd(factor, _mm512_maskz_loadu_pd(mask, x + i), _mm512_maskz_loadu_pd(mask, y + i));
+            _mm512_mask_storeu_pd(y + i, mask, result);
+        }
+    }
+#endif
+
+private:
+    InstructionSet  instruction_set;    ///< The instruction set of the selected functions
+    DotFunction     dot_function;       ///< Implementation of dot()
+    AxpyFunction    axpy_function;      ///< Implementation of axpy()
+};
+
+#endif	/* INSIDEOUTSIDEKERNEL_HPP */
@@ -0,0 +1,297 @@
+/*
+ * File:   InsideOutsideStorage.hpp
+ * Author: Johannes Gontrum
+ *
+ * Storage policies for the InsideOutsideCache.
+ */
+
+#ifndef INSIDEOUTSIDESTORAGE_HPP
+#define	INSIDEOUTSIDESTORAGE_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+#include "OpenAddressingTable.hpp"
+#include "ChartArena.hpp"
+
+#include <vector>
+#include <unordered_map>
+#include <limits>       // std::numeric_limits
+#include <cstdint>
+#include <bitset>
+#include <algorithm>
+
+#include "Tracing.hpp"
+
+// The type for the begin and end positions in the keys of the cache. Its width limits the
+// length of the sentences: 16 bit allow sentences with up to 65535 tokens. Together with
+// the 32 bit of a symbol, both positions must fit into a 64 bit key.
+#ifndef PCFGEM_LENGTH_TYPE
+#define PCFGEM_LENGTH_TYPE uint16_t
+#endif
+
+/*
+ * A storage policy keeps the inside and the outside value of (Symbol, begin, end) triples
+ * in slots with the members 'inside' and 'outside'. A negative value has not been stored yet.
+ * Every policy offers:
+ *
+ *   Storage(const ProbabilisticContextFreeGrammar& grammar, unsigned sentence_length, ChartArena * arena)
+ *       the arena (or nullptr) may be used for memory that lives as long as the storage
+ *   const Slot * find(const Symbol& symbol, LengthType begin, LengthType end) const
+ *       returns the slot of the triple or a nullpointer
+ *   Slot * insert(const Symbol& symbol, LengthType begin, LengthType end)
+ *       returns the (new) slot of the triple or a nullpointer, if the triple is not stored
+ *   std::size_t memory_usage() const
+ *   static const char * name()
+ *
+ * The pointers are only valid until the next insertion.
+ */
+
+/// A slot with both values of a triple.
+struct InsideOutsideSlot {
+    InsideOutsideSlot() : inside(-1), outside(-1) {
+    }
+
+    double inside;
+    double outside;
+};
+
+/// Concatenates the bits of a (Symbol, begin, end) triple to a 64 bit key for the hash maps.
+class CacheKey {
+public:
+    typedef ProbabilisticContextFreeGrammar::Symbol     Symbol;
+    typedef PCFGEM_LENGTH_TYPE                          LengthType;
+    typedef std::uint64_t                               Key;
+
+    static const unsigned length_bits = std::numeric_limits<LengthType>::digits;
+    static_assert(!std::numeric_limits<LengthType>::is_signed && 32 + 2 * length_bits <= 64,
+            "CacheKey: LengthType must be an unsigned type with at most 16 bit.");
+
+    static inline Key create(const Symbol& symbol, const LengthType& begin, const LengthType& end) {
+        Key buffer = symbol;     // assign the first 32bit in the buffer for the symbol
+        buffer = (buffer << length_bits) | begin;   // Now push the bits of begin in
+        buffer = (buffer << length_bits) | end;     // and the ones of end.
+        PCFGEM_VLOG(10) << "CacheKey: Converting <" << symbol << "," << (int)begin << "," << (int)end << "> to 64bit key: " << (std::bitset<64>) buffer;
+        return buffer;
+
+        /* Example:
+         * Assuming that Symbol is a 32bit type and LengthType is 8bit (the default is 16bit,
+         * but the principle is the same).
+         * For a better visualisation let's also assume, that the value of 'symbol'
+         * is '4294967295' - the maximum number that a 32bit type can store.
+         * Let's assign the value '0' to 'begin' and '255' to end;
+         * In binary, the variables would look like this:
+         * symbol = 11111111111111111111111111111111
+         * begin  = 00000000
+         * end    = 11111111
+         *
+         * In the first step, all 32 bits of 'symbol' are copied to the buffer.
+         * The buffer now has the value:
+         * 0000000000000000000000000000000011111111111111111111111111111111
+         * After this, 'begin' is 'attached' to the buffer:
+         * 0000000000000000000000001111111111111111111111111111111100000000
+         * And now, 'end':
+         * 0000000000000000111111111111111111111111111111110000000011111111
+         *
+         * In this way, it is possible to create a unique, hash-like value that can
+         * be used as a key in a map to find the already calculated inside probability
+         * for the symbol, begin and end.
+         */
+    }
+};
+
+/// The node based hash map of the standard library: one allocation per triple.
+class NodeMapStorage {
+public:
+    typedef InsideOutsideSlot                           Slot;
+    typedef CacheKey::Symbol                            Symbol;
+    typedef CacheKey::LengthType                        LengthType;
+
+    NodeMapStorage(const ProbabilisticContextFreeGrammar&, unsigned, ChartArena *) {
+    }
+
+    inline const Slot * find(const Symbol& symbol, LengthType begin, LengthType end) const {
+        Map::const_iterator cit = map.find(CacheKey::create(symbol, begin, end));
+        return cit != map.end() ? &(cit->second) : nullptr;
+    }
+
+    inline Slot * insert(const Symbol& symbol, LengthType begin, LengthType end) {
+        return &map[CacheKey::create(symbol, begin, end)];
+    }
+
+    std::size_t memory_usage() const {
+        // A node with the key, the slot and the pointer to the next node, plus one bucket pointer.
+        return map.size() * (sizeof(CacheKey::Key) + sizeof(Slot) + 2 * sizeof(void*)) + map.bucket_count() * sizeof(void*);
+    }
+
+    static const char * name() {
+        return "node";
+    }
+
+private:
+    typedef std::unordered_map<CacheKey::Key, Slot>     Map;
+
+    Map map;
+};
+
+/// The flat OpenAddressingTable with its slots from the arena. It starts with room for one
+/// key per span and grows with the triples that are actually stored.
+class FlatMapStorage {
+public:
+    typedef OpenAddressingTable::Slot                   Slot;
+    typedef CacheKey::Symbol                            Symbol;
+    typedef CacheKey::LengthType                        LengthType;
+
+    FlatMapStorage(const ProbabilisticContextFreeGrammar&, unsigned sentence_length, ChartArena * arena)
+    :
+    table(std::size_t(sentence_length) * (sentence_length + 1) / 2, arena) {
+    }
+
+    inline const Slot * find(const Symbol& symbol, LengthType begin, LengthType end) const {
+        return table.find(CacheKey::create(symbol, begin, end));
+    }
+
+    inline Slot * insert(const Symbol& symbol, LengthType begin, LengthType end) {
+        return &table.insert(CacheKey::create(symbol, begin, end));
+    }
+
+    std::size_t memory_usage() const {
+        return table.capacity() * sizeof(Slot);
+    }
+
+    static const char * name() {
+        return "flat";
+    }
+
+private:
+    OpenAddressingTable table;
+};
+
+/*
+ * An array with a slot for every nonterminal and every span, packed into a triangle per
+ * nonterminal like the InsideOutsideChart. No hashing at all, but the memory for all
+ * triples is allocated, even if only a few are needed. Values for terminal symbols are
+ * not stored, since they are trivial to compute. The array is taken from the arena, if one
+ * is given.
+ */
+class DenseTriangularStorage {
+public:
+    typedef InsideOutsideSlot                           Slot;
+    typedef CacheKey::Symbol                            Symbol;
+    typedef CacheKey::LengthType                        LengthType;
+
+    DenseTriangularStorage(const ProbabilisticContextFreeGrammar& pcfg, unsigned sentence_length, ChartArena * arena)
+    :
+    grammar(pcfg),
+    n(sentence_length),
+    triangle(std::size_t(sentence_length) * (sentence_length + 1) / 2),
+    no_of_slots(triangle * pcfg.no_of_nonterminals()),
+    slots((arena != nullptr ? *arena : own_arena).allocate<Slot>(no_of_slots, Slot())) {
+    }
+
+    DenseTriangularStorage(const DenseTriangularStorage&) = delete;
+    DenseTriangularStorage& operator=(const DenseTriangularStorage&) = delete;
+
+    /// The memory of the array for a sentence of the given length.
+    static std::size_t memory_usage(const ProbabilisticContextFreeGrammar& grammar, unsigned sentence_length) {
+        return std::size_t(sentence_length) * (sentence_length + 1) / 2 * grammar.no_of_nonterminals() * sizeof(Slot);
+    }
+
+    inline const Slot * find(const Symbol& symbol, LengthType begin, LengthType end) const {
+        ProbabilisticContextFreeGrammar::NonterminalID nt = grammar.get_nonterminal_id(symbol);
+        return nt >= 0 ? &slots[index(nt, begin, end)] : nullptr;
+    }
+
+    inline Slot * insert(const Symbol& symbol, LengthType begin, LengthType end) {
+        ProbabilisticContextFreeGrammar::NonterminalID nt = grammar.get_nonterminal_id(symbol);
+        return nt >= 0 ? &slots[index(nt, begin, end)] : nullptr;
+    }
+
+    std::size_t memory_usage() const {
+        return no_of_slots * sizeof(Slot);
+    }
+
+    static const char * name() {
+        return "dense";
+    }
+
+private:
+    inline std::size_t index(ProbabilisticContextFreeGrammar::NonterminalID nt, unsigned begin, unsigned end) const {
+        return nt * triangle + std::size_t(begin) * (2 * n - begin + 1) / 2 + (end - begin);
+    }
+
+private:
+    const ProbabilisticContextFreeGrammar&  grammar;
+    unsigned                                n;          ///< Length of the sentence
+    std::size_t                             triangle;   ///< Number of spans
+    std::size_t                             no_of_slots; ///< Number of spans times number of nonterminals
+    ChartArena                              own_arena;  ///< The memory, if no arena is given
+    Slot *                                  slots;
+};
+
+/*
+ * A short list of (symbol, slot) entries for every span, searched linearly. Only the symbols
+ * that are really asked for take memory, and all values of a span are close together.
+ * This is fast as long as only a few symbols per span are needed.
+ */
+class SparseCellStorage {
+public:
+    typedef InsideOutsideSlot                           Slot;
+    typedef CacheKey::Symbol                            Symbol;
+    typedef CacheKey::LengthType                        LengthType;
+
+    SparseCellStorage(const ProbabilisticContextFreeGrammar&, unsigned sentence_length, ChartArena *)
+    :
+    n(sentence_length),
+    cells(std::size_t(sentence_length) * (sentence_length + 1) / 2) {
+    }
+
+    inline const Slot * find(const Symbol& symbol, LengthType begin, LengthType end) const {
+        const Cell& cell = cells[index(begin, end)];
+        for (const Entry& entry : cell) {
+            if (entry.symbol == symbol) {
+                return &entry.slot;
+            }
+        }
+        return nullptr;
+    }
+
+    inline Slot * insert(const Symbol& symbol, LengthType begin, LengthType end) {
+        Cell& cell = cells[index(begin, end)];
+        for (Entry& entry : cell) {
+            if (entry.symbol == symbol) {
+                return &entry.slot;
+            }
+        }
+        cell.push_back(Entry{symbol, Slot()});
+        return &cell.back().slot;
+    }
+
+    std::size_t memory_usage() const {
+        std::size_t bytes = cells.capacity() * sizeof(Cell);
+        for (const Cell& cell : cells) {
+            bytes += cell.capacity() * sizeof(Entry);
+        }
+        return bytes;
+    }
+
+    static const char * name() {
+        return "sparse";
+    }
+
+private:
+    struct Entry {
+        Symbol  symbol;
+        Slot    slot;
+    };
+
+    typedef std::vector<Entry>  Cell;
+
+    inline std::size_t index(unsigned begin, unsigned end) const {
+        return std::size_t(begin) * (2 * n - begin + 1) / 2 + (end - begin);
+    }
+
+private:
+    unsigned            n;      ///< Length of the sentence
+    std::vector<Cell>   cells;  ///< The entries of every span
+};
+
+#endif	/* INSIDEOUTSIDESTORAGE_HPP */
@@ -0,0 +1,214 @@
+/*
+ * File:   InsideSpanCache.hpp
+ * Author: Johannes Gontrum
+ *
+ * Shares the inside values of equal word sequences between the charts of different sentences.
+ */
+
+#ifndef INSIDESPANCACHE_HPP
+#define	INSIDESPANCACHE_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * The inside values of a span only depend on the words of the span, not on the rest of the
+ * sentence. So when the same word sequence occurs in several sentences (names, phrases,
+ * repeated clauses), the ChartInsideOutsideCalculator can copy the cell from this cache
+ * instead of applying all binary rules at all split points.
+ *
+ * The entries are found by a hash of the word sequence, which the calculator computes in
+ * constant time from prefix hashes. Each entry also stores the words, so a collision is
+ * only a miss. Only the nonzero values of a cell are stored, together with the scaling
+ * exponent of the span. The cache has a memory budget: When it is exceeded, the least
+ * recently used entries are evicted. To reduce the contention between threads, the entries
+ * are distributed over several shards with their own lock and LRU list.
+ *
+ * The values are only valid for one snapshot of the grammar and for one configuration of
+ * the calculators (arithmetic and kernel), so the cache has to be cleared whenever the
+ * probabilities change, i.e. after every maximisation step.
+ */
+class InsideSpanCache {
+public:
+    typedef ProbabilisticContextFreeGrammar::Symbol         Symbol;
+    typedef ProbabilisticContextFreeGrammar::NonterminalID  NonterminalID;
+    typedef double                                          InsideOutsideProbability;
+    typedef std::uint64_t                                   Hash;
+
+    /// Counters since the last clear().
+    struct Statistics {
+        std::size_t lookups;
+        std::size_t hits;
+        std::size_t insertions;
+        std::size_t evictions;
+        std::size_t bytes;      ///< Current size of all entries
+
+        double hit_rate() const {
+            return lookups > 0 ? double(hits) / lookups : 0;
+        }
+    };
+
+private:
+    typedef std::vector<Symbol>                                     SymbolVector;
+    typedef std::vector<std::pair<NonterminalID, InsideOutsideProbability> > ValueVector;
+    typedef std::list<Hash>                                         LRUList;
+
+    struct Entry {
+        SymbolVector        words;
+        ValueVector         values;     ///< Nonzero values of the cell
+        int                 exponent;   ///< Scaling exponent of the span
+        LRUList::iterator   position;   ///< Position in the LRU list of the shard
+    };
+
+    struct Shard {
+        std::mutex                          mutex;
+        std::unordered_map<Hash, Entry>     entries;
+        LRUList                             lru;        ///< Most recently used first
+        Statistics                          statistics;
+    };
+
+    static const unsigned no_of_shards = 16;
+
+public:
+    /// A cache that uses about budget bytes. Only spans with at least min_span_length words are cached.
+    InsideSpanCache(std::size_t budget, unsigned min_span_length = 3)
+    :
+    shard_budget(budget / no_of_shards),
+    min_length(std::max(2u, min_span_length)),
+    shards(no_of_shards) {
+        clear();
+    }
+
+    unsigned get_min_length() const {
+        return min_length;
+    }
+
+    /// Removes all entries and resets the statistics.
+    void clear() {
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.lru.clear();
+            shard.statistics = Statistics{0, 0, 0, 0, 0};
+        }
+    }
+
+    /// Copies the cached values of the words into the cell of no_of_nts values (all other values are set to 0)
+    /// and their exponent. Returns false, if they are not in the cache.
+    bool lookup(Hash hash, const Symbol * words, unsigned length, InsideOutsideProbability * cell, NonterminalID no_of_nts, int& exponent) {
+        Shard& shard = shard_for(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ++shard.statistics.lookups;
+        auto entry = shard.entries.find(hash);
+        if (entry == shard.entries.end() || !same_words(entry->second.words, words, length)) {
+            return false;
+        }
+        ++shard.statistics.hits;
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry->second.position);
+
+        std::fill(cell, cell + no_of_nts, 0);
+        for (const auto& value : entry->second.values) {
+            cell[value.first] = value.second;
+        }
+        exponent = entry->second.exponent;
+        return true;
+    }
+
+    /// Stores the no_of_nts values of a cell for the words and evicts old entries, if the budget is exceeded.
+    void insert(Hash hash, const Symbol * words, unsigned length, const InsideOutsideProbability * cell, NonterminalID no_of_nts, int exponent) {
+        Entry entry;
+        entry.words.assign(words, words + length);
+        for (NonterminalID nt = 0; nt < no_of_nts; ++nt) {
+            if (cell[nt] != 0) {
+                entry.values.push_back(std::make_pair(nt, cell[nt]));
+            }
+        }
+        entry.exponent = exponent;
+        std::size_t bytes = entry_size(entry);
+
+        Shard& shard = shard_for(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto old = shard.entries.find(hash);
+        if (old != shard.entries.end()) {
+            // Another thread was faster, or a different word sequence with the same hash.
+            shard.statistics.bytes -= entry_size(old->second);
+            shard.lru.erase(old->second.position);
+            shard.entries.erase(old);
+        }
+        while (!shard.lru.empty() && shard.statistics.bytes + bytes > shard_budget) {
+            auto victim = shard.entries.find(shard.lru.back());
+            shard.statistics.bytes -= entry_size(victim->second);
+            shard.entries.erase(victim);
+            shard.lru.pop_back();
+            ++shard.statistics.evictions;
+        }
+        if (bytes > shard_budget) {
+            return;
+        }
+        shard.lru.push_front(hash);
+        entry.position = shard.lru.begin();
+        shard.entries.insert(std::make_pair(hash, std::move(entry)));
+        shard.statistics.bytes += bytes;
+        ++shard.statistics.insertions;
+    }
+
+    /// The sum of the statistics of all shards.
+    Statistics get_statistics() {
+        Statistics sum{0, 0, 0, 0, 0};
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            sum.lookups += shard.statistics.lookups;
+            sum.hits += shard.statistics.hits;
+            sum.insertions += shard.statistics.insertions;
+            sum.evictions += shard.statistics.evictions;
+            sum.bytes += shard.statistics.bytes;
+        }
+        return sum;
+    }
+
+    /// Hash of the word sequence [begin, end) of a sentence, given the prefix hashes and powers
+    /// from prefix_hashes().
+    static inline Hash span_hash(const std::vector<Hash>& prefixes, const std::vector<Hash>& powers, unsigned begin, unsigned end) {
+        return prefixes[end] - prefixes[begin] * powers[end - begin];
+    }
+
+    /// Computes the polynomial hashes of all prefixes of a sentence (modulo 2^64) and the powers of the base.
+    static void prefix_hashes(const SymbolVector& sentence, std::vector<Hash>& prefixes, std::vector<Hash>& powers) {
+        prefixes.assign(sentence.size() + 1, 0);
+        powers.assign(sentence.size() + 1, 1);
+        for (unsigned i = 0; i < sentence.size(); ++i) {
+            prefixes[i + 1] = prefixes[i] * hash_base + Hash(sentence[i]) + 1;
+            powers[i + 1] = powers[i] * hash_base;
+        }
+    }
+
+private:
+    static const Hash hash_base = 0x9E3779B97F4A7C15ULL;
+
+    inline Shard& shard_for(Hash hash) {
+        return shards[(hash >> 59) % no_of_shards];
+    }
+
+    static bool same_words(const SymbolVector& stored, const Symbol * words, unsigned length) {
+        return stored.size() == length && std::equal(stored.begin(), stored.end(), words);
+    }
+
+    static std::size_t entry_size(const Entry& entry) {
+        return sizeof(Entry) + sizeof(Hash) * 4 + entry.words.capacity() * sizeof(Symbol)
+                + entry.values.capacity() * sizeof(ValueVector::value_type);
+    }
+
+private:
+    std::size_t         shard_budget;   ///< Memory per shard in bytes
+    unsigned            min_length;     ///< Shorter spans are cheaper to compute than to look up
+    std::vector<Shard>  shards;
+};
+
+#endif	/* INSIDESPANCACHE_HPP */
@@ -0,0 +1,142 @@
+/*
+ * File:   OpenAddressingTable.hpp
+ * Author: Johannes Gontrum
+ *
+ * A flat hash table from 64 bit keys to a pair of inside and outside values.
+ */
+
+#ifndef OPENADDRESSINGTABLE_HPP
+#define	OPENADDRESSINGTABLE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#include "ChartArena.hpp"
+
+/*
+ * All entries are stored in one array (open addressing), so a lookup does not follow any
+ * pointers and an insertion does not allocate memory. The position of a key is computed
+ * with Fibonacci hashing (multiplication with 2^64 / golden ratio, the highest bits are the
+ * position), collisions are resolved by linear probing. The table has a power of two slots
+ * and grows, when more than half of them are used, so the probe sequences stay short.
+ * Entries are never removed.
+ *
+ * Every slot holds the inside and the outside value of its key, so both are found with
+ * the same probe and lie in the same cache line. A value that has not been stored yet is
+ * negative.
+ *
+ * The slots are taken from a ChartArena, so a table per sentence costs no allocation once the
+ * arena of the worker has grown to the largest sentence. When the table grows, the old slots
+ * stay in the arena until it is reset.
+ */
+class OpenAddressingTable {
+public:
+    typedef std::uint64_t   Key;
+    typedef double          Value;
+
+    struct Slot {
+        Key     key;
+        Value   inside;
+        Value   outside;
+    };
+
+    /// Marks an empty slot. The cache never creates this key, since it would need a negative symbol.
+    static const Key empty_key = ~Key(0);
+
+public:
+    /// A table for about the given number of keys, with its slots from the arena (or from an own one).
+    explicit OpenAddressingTable(std::size_t expected_keys = 0, ChartArena * arena = nullptr)
+    :
+    memory(arena != nullptr ? *arena : own_arena),
+    slots(nullptr),
+    no_of_slots(0),
+    no_of_keys(0) {
+        resize(slots_for(expected_keys));
+    }
+
+    OpenAddressingTable(const OpenAddressingTable&) = delete;
+    OpenAddressingTable& operator=(const OpenAddressingTable&) = delete;
+
+    /// Returns the slot of the key or a nullpointer.
+    inline const Slot * find(Key key) const {
+        for (std::size_t position = home(key); ; position = (position + 1) & mask) {
+            const Slot& slot = slots[position];
+            if (slot.key == key) {
+                return &slot;
+            }
+            if (slot.key == empty_key) {
+                return nullptr;
+            }
+        }
+    }
+
+    /// Returns the slot of the key. If the key is new, both of its values are negative.
+    inline Slot& insert(Key key) {
+        if (2 * (no_of_keys + 1) > no_of_slots) {
+            resize(2 * no_of_slots);
+        }
+        std::size_t position = home(key);
+        while (slots[position].key != key && slots[position].key != empty_key) {
+            position = (position + 1) & mask;
+        }
+        Slot& slot = slots[position];
+        if (slot.key == empty_key) {
+            slot.key = key;
+            ++no_of_keys;
+        }
+        return slot;
+    }
+
+    std::size_t size() const {
+        return no_of_keys;
+    }
+
+    std::size_t capacity() const {
+        return no_of_slots;
+    }
+
+private:
+    /// The smallest power of two with at least twice as many slots as keys.
+    static std::size_t slots_for(std::size_t keys) {
+        std::size_t result = 16;
+        while (result < 2 * keys) {
+            result *= 2;
+        }
+        return result;
+    }
+
+    inline std::size_t home(Key key) const {
+        return (key * 0x9E3779B97F4A7C15ULL) >> shift;
+    }
+
+    /// Moves all keys into a new array with the given number of slots (a power of two).
+    void resize(std::size_t new_size) {
+        Slot * old = slots;
+        std::size_t old_size = no_of_slots;
+        slots = memory.allocate<Slot>(new_size, Slot{empty_key, -1, -1});
+        no_of_slots = new_size;
+        mask = new_size - 1;
+        shift = 64;
+        for (std::size_t s = new_size; s > 1; s /= 2) {
+            --shift;
+        }
+        no_of_keys = 0;
+        for (std::size_t s = 0; s < old_size; ++s) {
+            if (old[s].key != empty_key) {
+                insert(old[s].key) = old[s];
+            }
+        }
+    }
+
+private:
+    ChartArena          own_arena;  ///< The memory, if no arena is given
+    ChartArena&         memory;     ///< Where the slots come from
+    Slot *              slots;      ///< The array of all slots
+    std::size_t         no_of_slots;///< Number of slots, a power of two
+    std::size_t         no_of_keys; ///< Number of used slots
+    std::size_t         mask;       ///< Number of slots - 1
+    unsigned            shift;      ///< 64 - log2(number of slots)
+};
+
+#endif	/* OPENADDRESSINGTABLE_HPP */
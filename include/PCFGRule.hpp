@@ -15,7 +15,7 @@
 #include <boost/tokenizer.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/lexical_cast.hpp> // to cast a string to double
-#include "easylogging++.h"
+#include "Tracing.hpp"
 #include "Signature.hpp"
 
 /// A weighted rule
@@ -41,11 +41,21 @@ public:
         this->signature = &signature;
         valid = parse_rule(s);
         if (valid) {
-            VLOG(9) << "PCFGRule: Rule for '" << *this << "' successfully created.";
+            PCFGEM_VLOG(9) << "PCFGRule: Rule for '" << *this << "' successfully created.";
         } else {
             LOG(WARNING) << "PCFGRule: Rule for '" << *this << "' could not be created.";
         }
     }
+
+    /// Creates a rule from symbols that already exist in the signature (e.g. from a GrammarImage).
+    PCFGRule(ID lhs, IDVector rhs, Probability prob, ExtSignature& signature)
+    :
+    lhs(lhs),
+    rhs(std::move(rhs)),
+    prob(prob),
+    valid(true),
+    signature(&signature) {
+    }
     
 
     //////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,232 @@
+/*
+ * File:   ParallelCorpusLoader.hpp
+ * Author: Johannes Gontrum
+ *
+ * Reads a text corpus in newline-aligned chunks, which are tokenized in several threads.
+ */
+
+#ifndef PARALLELCORPUSLOADER_HPP
+#define	PARALLELCORPUSLOADER_HPP
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <future>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Corpus.hpp"
+#include "Signature.hpp"
+#include "Tracing.hpp"
+
+/*
+ * Reads the same sentences as EMTrainer::read_in, but the file is mapped into memory and cut into
+ * chunks of about chunk_bytes, each ending after a newline. The chunks are tokenized and their
+ * words looked up in the signature by up to no_of_threads tasks at a time. The signature is only
+ * read (resolve_symbol), so it must not be changed while the corpus is loaded.
+ *
+ * The results of the chunks are added to the corpus in the order of the file, while the next
+ * chunks are still being tokenized. Since all chunks but the last end with a newline, the number
+ * of the first line of a chunk is known from the newlines of the chunks before it, so the unknown
+ * words are reported with the same line numbers as by the sequential reader. The sentences are
+ * also added in the same order, so the corpus is identical.
+ */
+class ParallelCorpusLoader {
+public:
+    typedef Corpus::Symbol                  Symbol;
+    typedef Signature<std::string>          ExtSignature;
+
+public:
+    /// Maps the file. Check is_open() afterwards.
+    ParallelCorpusLoader(const std::string& file_path, unsigned threads, std::size_t chunk_size = 4 << 20)
+    :
+    path(file_path),
+    mapping(nullptr),
+    mapping_size(0),
+    opened(false),
+    no_of_threads(std::max(1u, threads)),
+    chunk_bytes(std::max<std::size_t>(1, chunk_size)) {
+        map_file();
+    }
+
+    ~ParallelCorpusLoader() {
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    ParallelCorpusLoader(const ParallelCorpusLoader&) = delete;
+    ParallelCorpusLoader& operator=(const ParallelCorpusLoader&) = delete;
+
+    bool is_open() const {
+        return opened;
+    }
+
+    /// True, if the file is a regular file, which can be mapped. Pipes are read with EMTrainer::read_in.
+    static bool is_mappable(const std::string& file_path) {
+        struct stat status;
+        return stat(file_path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+    }
+
+    /*
+     * Adds the sentences of the file to the corpus. The sentences with a word that is not in the
+     * signature are left out and reported. Returns the number of non-empty lines.
+     */
+    unsigned read(const ExtSignature& signature, Corpus& corpus) const {
+        std::vector<const char*> bounds = chunk_bounds();
+        std::deque<std::future<Chunk>> pending;
+        std::size_t next_chunk = 0;
+        unsigned line_no = 1;
+        unsigned lines = 0;
+
+        while (next_chunk + 1 < bounds.size() || !pending.empty()) {
+            while (next_chunk + 1 < bounds.size() && pending.size() < no_of_threads) {
+                pending.push_back(std::async(std::launch::async, &ParallelCorpusLoader::tokenize, &signature,
+                        bounds[next_chunk], bounds[next_chunk + 1]));
+                ++next_chunk;
+            }
+            Chunk chunk = pending.front().get();
+            pending.pop_front();
+
+            for (const std::pair<unsigned, std::string>& error : chunk.errors) {
+                LOG(ERROR) << "EMTrainer: Sentence in line " << line_no + error.first << " will be ignored, the token '" << error.second << "' cannot be resolved.";
+            }
+            const Symbol * words = chunk.symbols.data();
+            for (unsigned length : chunk.lengths) {
+                corpus.add(words, length);
+                words += length;
+            }
+            line_no += chunk.newlines;
+            lines += chunk.lines;
+            release(chunk.end);
+        }
+        PCFGEM_VLOG(2) << "ParallelCorpusLoader: Read " << lines << " lines in " << bounds.size() - 1 << " chunks from '" << path << "'.";
+        return lines;
+    }
+
+private:
+    /// The valid sentences of a chunk and the unknown words, by the line within the chunk.
+    struct Chunk {
+        const char *                                    end;
+        std::vector<Symbol>                             symbols;    ///< The words of the valid sentences
+        std::vector<unsigned>                           lengths;    ///< The length of each valid sentence
+        std::vector<std::pair<unsigned, std::string>>   errors;     ///< Line in the chunk, unknown word
+        unsigned                                        newlines = 0;
+        unsigned                                        lines = 0;  ///< The non-empty lines
+    };
+
+    /// The chunks are [bounds[c], bounds[c + 1]), every chunk but the last ends after a newline.
+    std::vector<const char*> chunk_bounds() const {
+        const char * begin = (const char*) mapping;
+        const char * end = begin + mapping_size;
+        std::vector<const char*> bounds(1, begin);
+        while (bounds.back() != end) {
+            const char * position = bounds.back() + std::min<std::size_t>(chunk_bytes, end - bounds.back()) - 1;
+            const char * newline = (const char*) std::memchr(position, '\n', end - position);
+            bounds.push_back(newline != nullptr ? newline + 1 : end);
+        }
+        return bounds;
+    }
+
+    /// Splits the lines of a chunk at blanks and tabs like EMTrainer::read_in, and looks up the words.
+    static Chunk tokenize(const ExtSignature * signature, const char * begin, const char * end) {
+        Chunk chunk;
+        chunk.end = end;
+        std::string word;
+        for (const char * line = begin; line != end; ) {
+            const char * line_end = (const char*) std::memchr(line, '\n', end - line);
+            if (line_end == nullptr) {
+                line_end = end;
+            }
+            if (line != line_end) {
+                std::size_t first_word = chunk.symbols.size();
+                bool valid = true;
+                for (const char * c = line; c != line_end; ) {
+                    if (*c == ' ' || *c == '\t') {
+                        ++c;
+                        continue;
+                    }
+                    const char * word_end = c;
+                    while (word_end != line_end && *word_end != ' ' && *word_end != '\t') {
+                        ++word_end;
+                    }
+                    word.assign(c, word_end);
+                    Symbol word_as_id = signature->resolve_symbol(word);
+                    if (word_as_id < 0) {
+                        chunk.errors.push_back(std::make_pair(chunk.newlines, word));
+                        valid = false;
+                    }
+                    chunk.symbols.push_back(word_as_id);
+                    c = word_end;
+                }
+                ++chunk.lines;
+                if (valid && chunk.symbols.size() > first_word) {
+                    chunk.lengths.push_back(chunk.symbols.size() - first_word);
+                } else {
+                    chunk.symbols.resize(first_word);
+                }
+            }
+            if (line_end == end) {
+                break;
+            }
+            ++chunk.newlines;
+            line = line_end + 1;
+        }
+        return chunk;
+    }
+
+    /// Gives the pages before the given position back to the system, they are not read again.
+    void release(const char * position) const {
+        std::size_t page_size = sysconf(_SC_PAGESIZE);
+        std::size_t end = (position - (const char*) mapping) / page_size * page_size;
+        if (end > 0) {
+            madvise(mapping, end, MADV_DONTNEED);
+        }
+    }
+
+    void map_file() {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0) {
+            LOG(ERROR) << "ParallelCorpusLoader: Cannot open the file '" << path << "'.";
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        mapping_size = status.st_size;
+        if (mapping_size == 0) {
+            // An empty corpus cannot be mapped, but it is valid.
+            close(fd);
+            opened = true;
+            return;
+        }
+        void * address = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            LOG(ERROR) << "ParallelCorpusLoader: Cannot map the file '" << path << "'.";
+            return;
+        }
+        mapping = (unsigned char*) address;
+        madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+        opened = true;
+    }
+
+private:
+    std::string         path;
+    unsigned char *     mapping;
+    std::uint64_t       mapping_size;
+    bool                opened;
+    unsigned            no_of_threads;  ///< The chunks that are tokenized at the same time
+    std::size_t         chunk_bytes;    ///< The size of a chunk, it is extended to the next newline
+};
+
+#endif	/* PARALLELCORPUSLOADER_HPP */
@@ -0,0 +1,334 @@
+/*
+ * File:   ParseForest.hpp
+ * Author: Johannes Gontrum
+ *
+ * The pruned hypergraph of all derivations of one sentence, reused across EM iterations.
+ */
+
+#ifndef PARSEFOREST_HPP
+#define	PARSEFOREST_HPP
+
+#include "ProbabilisticContextFreeGrammar.hpp"
+#include "CompiledGrammar.hpp"
+#include "ChartInsideOutsideCalculator.hpp"
+#include "InsideOutsideChart.hpp"
+#include "ChartArena.hpp"
+#include "ExpectedCounts.hpp"
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+/*
+ * Which items (nonterminal, begin, end) of a sentence have a nonzero inside and outside value,
+ * and which rule applications (hyperedges) connect them, only depends on the rules with a
+ * nonzero probability, not on the probabilities themselves. Since a rule that got the
+ * probability 0 never gets a positive one again, the forest that is recorded from a filled
+ * chart stays valid for all later iterations: It contains every derivation of the sentence.
+ *
+ * The items are numbered bottom-up (shorter spans first), so the inside values are computed
+ * by one scan over the items and their edges, and the outside values and the expectations
+ * by one scan in the opposite direction. The edges of an item are stored contiguously
+ * (compressed sparse rows), an edge of a single word has no children.
+ *
+ * Like the ChartInsideOutsideCalculator, the values are stored divided by a power of two,
+ * here one per item, so long sentences do not underflow.
+ */
+class ParseForest {
+public:
+    typedef ProbabilisticContextFreeGrammar::NonterminalID  NonterminalID;
+    typedef ProbabilisticContextFreeGrammar::RuleID         RuleID;
+    typedef ProbabilisticContextFreeGrammar::Probability    Probability;
+    typedef std::vector<Probability>                        ProbabilityVector;
+
+    /// A rule application: the item of its lhs is the item the edge belongs to.
+    struct Edge {
+        RuleID      rule;   ///< Dense ID of the rule in the grammar
+        unsigned    left;   ///< Item of the first child, no_child for preterminal rules
+        unsigned    right;  ///< Item of the second child, no_child for preterminal rules
+    };
+
+    typedef std::vector<Edge>                               EdgeVector;
+
+    static const unsigned no_child = std::numeric_limits<unsigned>::max();
+
+private:
+    typedef std::vector<unsigned>                           OffsetVector;
+    typedef std::vector<NonterminalID>                      NonterminalVector;
+    typedef CompiledGrammar::BinaryRule                     BinaryRule;
+    typedef CompiledGrammar::BinaryRuleRange                BinaryRuleRange;
+    typedef CompiledGrammar::LexicalRule                    LexicalRule;
+    typedef CompiledGrammar::LexicalRuleRange               LexicalRuleRange;
+
+public:
+    /// An empty forest: the sentence has no derivation.
+    ParseForest() : edge_offsets(1, 0) {
+    }
+
+    /// Records the forest from a calculator, whose inside and outside passes are complete.
+    /// If the forest has more than max_items items or gets more than max_edges edges, the forest stays empty.
+    ParseForest(const CompiledGrammar& grammar, const std::vector<ProbabilisticContextFreeGrammar::Symbol>& sentence,
+            const ChartInsideOutsideCalculator& iocalc, std::size_t max_items = std::numeric_limits<std::size_t>::max(),
+            std::size_t max_edges = std::numeric_limits<std::size_t>::max())
+    :
+    edge_offsets(1, 0) {
+        const InsideOutsideChart& chart = iocalc.get_chart();
+        unsigned n = sentence.size();
+        unsigned no_of_nts = grammar.no_of_nonterminals();
+        if (n == 0 || grammar.get_start_id() < 0 || chart.inside(grammar.get_start_id(), 0, n - 1) == 0) {
+            return;
+        }
+
+        // Counting the items is cheap compared to collecting the edges.
+        if (max_items < std::numeric_limits<std::size_t>::max() && count_items(chart) > max_items) {
+            return;
+        }
+
+        // Item IDs of the useful items in a triangle per nonterminal, only needed while recording.
+        std::size_t triangle = std::size_t(n) * (n + 1) / 2;
+        std::vector<unsigned> ids(triangle * no_of_nts, unsigned(no_child));
+        auto index = [n, triangle](NonterminalID nt, unsigned begin, unsigned end) {
+            return nt * triangle + std::size_t(begin) * (2 * n - begin + 1) / 2 + (end - begin);
+        };
+
+        for (unsigned span = 1; span <= n; ++span) {
+            for (unsigned begin = 0; begin + span <= n; ++begin) {
+                unsigned end = begin + span - 1;
+                for (NonterminalID nt = 0; nt < (NonterminalID) no_of_nts; ++nt) {
+                    if (chart.inside(nt, begin, end) == 0 || chart.outside(nt, begin, end) == 0) {
+                        continue;
+                    }
+                    unsigned item = nonterminals.size();
+                    ids[index(nt, begin, end)] = item;
+                    nonterminals.push_back(nt);
+
+                    if (span == 1) {
+                        LexicalRuleRange rules = grammar.rules_for_terminal(sentence[begin]);
+                        for (const LexicalRule * rule = rules.first; rule != rules.second; ++rule) {
+                            if (rule->lhs == nt && rule->prob > 0) {
+                                edges.push_back(Edge{rule->id, no_child, no_child});
+                            }
+                        }
+                    } else {
+                        // The children of a useful item are useful, if both have a derivation.
+                        BinaryRuleRange rules = grammar.rules_for_lhs(nt);
+                        for (const BinaryRule * rule = rules.first; rule != rules.second; ++rule) {
+                            if (rule->prob == 0) {
+                                continue;
+                            }
+                            for (unsigned k = begin; k < end; ++k) {
+                                unsigned left = ids[index(rule->left, begin, k)];
+                                unsigned right = ids[index(rule->right, k + 1, end)];
+                                if (left != no_child && right != no_child) {
+                                    edges.push_back(Edge{rule->id, left, right});
+                                }
+                            }
+                        }
+                    }
+                    edge_offsets.push_back(edges.size());
+                    if (edges.size() > max_edges) {
+                        *this = ParseForest();
+                        return;
+                    }
+                }
+            }
+        }
+        // The last item is the start symbol over the whole sentence: It is the only useful item of this span.
+        assert(!nonterminals.empty() && nonterminals.back() == grammar.get_start_id());
+        nonterminals.shrink_to_fit();
+        edges.shrink_to_fit();
+        edge_offsets.shrink_to_fit();
+    }
+
+    /// False, if the sentence has no derivation.
+    bool has_derivation() const {
+        return !nonterminals.empty();
+    }
+
+    unsigned no_of_items() const {
+        return nonterminals.size();
+    }
+
+    unsigned no_of_edges() const {
+        return edges.size();
+    }
+
+    /// Approximate memory of the forest in bytes.
+    std::size_t memory_usage() const {
+        return nonterminals.capacity() * sizeof(NonterminalID) + edges.capacity() * sizeof(Edge)
+                + edge_offsets.capacity() * sizeof(unsigned);
+    }
+
+    /*
+     * Appends the forest to a byte buffer. All numbers are written as varints (7 bits per byte,
+     * the highest bit marks that another byte follows): the number of items and edges, then for
+     * every item its nonterminal and number of edges, followed by the edges. The children of an
+     * edge are stored as the distance to the item of the edge, which is small for most edges,
+     * a distance of 0 marks an edge without children.
+     */
+    void encode(std::vector<unsigned char>& buffer) const {
+        write_varint(buffer, nonterminals.size());
+        write_varint(buffer, edges.size());
+        for (unsigned item = 0; item < nonterminals.size(); ++item) {
+            write_varint(buffer, nonterminals[item]);
+            write_varint(buffer, edge_offsets[item + 1] - edge_offsets[item]);
+            for (unsigned e = edge_offsets[item]; e < edge_offsets[item + 1]; ++e) {
+                write_varint(buffer, edges[e].rule);
+                if (edges[e].left == no_child) {
+                    write_varint(buffer, 0);
+                } else {
+                    write_varint(buffer, item - edges[e].left);
+                    write_varint(buffer, item - edges[e].right);
+                }
+            }
+        }
+    }
+
+    /// Replaces the forest with the one encoded at the given position and returns the position after it.
+    const unsigned char * decode(const unsigned char * data) {
+        unsigned no_of_items = read_varint(data);
+        unsigned no_of_edges = read_varint(data);
+        nonterminals.resize(no_of_items);
+        edges.resize(no_of_edges);
+        edge_offsets.resize(no_of_items + 1);
+        edge_offsets[0] = 0;
+        unsigned e = 0;
+        for (unsigned item = 0; item < no_of_items; ++item) {
+            nonterminals[item] = read_varint(data);
+            edge_offsets[item + 1] = edge_offsets[item] + read_varint(data);
+            for (; e < edge_offsets[item + 1]; ++e) {
+                edges[e].rule = read_varint(data);
+                unsigned distance = read_varint(data);
+                if (distance == 0) {
+                    edges[e].left = edges[e].right = no_child;
+                } else {
+                    edges[e].left = item - distance;
+                    edges[e].right = item - read_varint(data);
+                }
+            }
+        }
+        return data;
+    }
+
+    /*
+     * Runs the inside and outside passes with the given probabilities, indexed by the dense
+     * rule IDs, and adds the expectations of the rules and nonterminals to the counts.
+     * Returns the logarithm of the probability of the sentence (-inf without a derivation).
+     * The values of the passes are taken from the arena, if one is given.
+     */
+    Probability estimate(const ProbabilityVector& rule_probs, ExpectedCounts& counts, ChartArena * arena = nullptr) const {
+        if (!has_derivation()) {
+            return -std::numeric_limits<Probability>::infinity();
+        }
+        ChartArena own_arena;
+        ChartArena& memory = arena != nullptr ? *arena : own_arena;
+        unsigned no_of_items = nonterminals.size();
+        Probability * inside = memory.allocate<Probability>(no_of_items);
+        Probability * outside = memory.allocate<Probability>(no_of_items, 0);
+        int * exponents = memory.allocate<int>(no_of_items);
+        // The factor 2^(E(left) + E(right) - E(item)) of every edge, used in both passes.
+        Probability * weights = memory.allocate<Probability>(edges.size());
+
+        for (unsigned item = 0; item < no_of_items; ++item) {
+            const Edge * first = edges.data() + edge_offsets[item];
+            const Edge * last = edges.data() + edge_offsets[item + 1];
+            // The edges are summed up relative to the largest exponent of the children.
+            int reference = std::numeric_limits<int>::min();
+            for (const Edge * edge = first; edge != last; ++edge) {
+                reference = std::max(reference, child_exponent(*edge, exponents));
+            }
+            Probability sum = 0;
+            for (const Edge * edge = first; edge != last; ++edge) {
+                Probability& weight = weights[edge - edges.data()];
+                weight = std::ldexp(1.0, child_exponent(*edge, exponents) - reference);
+                sum += rule_probs[edge->rule] * child_product(*edge, inside) * weight;
+            }
+            int shift = 0;
+            inside[item] = std::frexp(sum, &shift);
+            exponents[item] = reference + shift;
+            if (shift != 0) {
+                for (const Edge * edge = first; edge != last; ++edge) {
+                    weights[edge - edges.data()] = std::ldexp(weights[edge - edges.data()], -shift);
+                }
+            }
+        }
+
+        unsigned root = no_of_items - 1;
+        if (inside[root] == 0) {
+            return -std::numeric_limits<Probability>::infinity();
+        }
+        Probability inverted_pi = 1 / inside[root];
+        outside[root] = 1;
+
+        for (unsigned item = no_of_items; item-- > 0; ) {
+            Probability score = outside[item];
+            if (score == 0) {
+                continue;
+            }
+            counts.add_symbol(nonterminals[item], inside[item] * score * inverted_pi);
+            for (unsigned e = edge_offsets[item]; e < edge_offsets[item + 1]; ++e) {
+                const Edge& edge = edges[e];
+                Probability parent = rule_probs[edge.rule] * score * weights[e];
+                if (edge.left == no_child) {
+                    counts.add_rule(edge.rule, parent * inverted_pi);
+                } else {
+                    outside[edge.left] += parent * inside[edge.right];
+                    outside[edge.right] += parent * inside[edge.left];
+                    counts.add_rule(edge.rule, parent * inside[edge.left] * inside[edge.right] * inverted_pi);
+                }
+            }
+        }
+        return std::log(inside[root]) + exponents[root] * std::log(2.0);
+    }
+
+private:
+    /// The number of items with a nonzero inside and outside value.
+    static std::size_t count_items(const InsideOutsideChart& chart) {
+        std::size_t items = 0;
+        unsigned n = chart.get_sentence_length();
+        for (NonterminalID nt = 0; nt < (NonterminalID) chart.get_no_of_nonterminals(); ++nt) {
+            for (unsigned begin = 0; begin < n; ++begin) {
+                for (unsigned end = begin; end < n; ++end) {
+                    items += chart.inside(nt, begin, end) != 0 && chart.outside(nt, begin, end) != 0;
+                }
+            }
+        }
+        return items;
+    }
+
+    static inline void write_varint(std::vector<unsigned char>& buffer, unsigned value) {
+        while (value >= 0x80) {
+            buffer.push_back((unsigned char) (value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back((unsigned char) value);
+    }
+
+    static inline unsigned read_varint(const unsigned char *& data) {
+        unsigned value = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            unsigned char byte = *data++;
+            value |= unsigned(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    static inline int child_exponent(const Edge& edge, const int * exponents) {
+        return edge.left == no_child ? 0 : exponents[edge.left] + exponents[edge.right];
+    }
+
+    static inline Probability child_product(const Edge& edge, const Probability * inside) {
+        return edge.left == no_child ? 1 : inside[edge.left] * inside[edge.right];
+    }
+
+private:
+    NonterminalVector   nonterminals;   ///< Nonterminal of every item, shorter spans first
+    EdgeVector          edges;          ///< All edges, grouped by the item of their lhs
+    OffsetVector        edge_offsets;   ///< The edges of item i are [edge_offsets[i], edge_offsets[i + 1])
+};
+
+#endif	/* PARSEFOREST_HPP */
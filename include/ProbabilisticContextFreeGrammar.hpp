@@ -11,6 +11,8 @@
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <memory>
 
 #include <boost/tokenizer.hpp>
 #include <boost/unordered_set.hpp>
@@ -18,8 +20,9 @@
 
 #include "PCFGRule.hpp"
 #include "Signature.hpp"
+#include "GrammarImage.hpp"
 
-#include "easylogging++.h"
+#include "Tracing.hpp"
 
 /// Represents a PCFG with a signature.
 class ProbabilisticContextFreeGrammar {
@@ -30,6 +33,8 @@ public:
     typedef Signature<ExternalSymbol>                   ExtSignature;
     typedef std::vector<const PCFGRule*>                RulePointerVector;
     typedef PCFGRule::Probability                       Probability;
+    typedef int32_t                                     NonterminalID;
+    typedef unsigned                                    RuleID;
 
 private:
     typedef SymbolSet::const_iterator                          SymbolSetIter;
@@ -37,6 +42,8 @@ private:
     typedef std::unordered_map<Symbol, RulePointerVector>      SymbolToRuleVectorMap;
     typedef std::unordered_map<Symbol, unsigned>               SymbolToCounterMap;
     typedef std::unordered_map<Symbol, Probability>            SymbolToProbabilityMap;
+    typedef std::vector<NonterminalID>                         SymbolToNonterminalIDVector;
+    typedef std::vector<Symbol>                                SymbolVector;
 
 
 public:
@@ -61,6 +68,53 @@ public: // Functions
         normalize_probabilities();
     }
 
+    /// Constructs a grammar from a compiled grammar (see write_image()). The image already
+    /// contains the sorted and normalized rules and the rhs indexes, so nothing has to be parsed.
+    /// The image may be closed afterwards. Returns a nullpointer, if the image is incomplete or
+    /// corrupt (the problem is logged).
+    static std::unique_ptr<ProbabilisticContextFreeGrammar> from_image(const GrammarImage& image) {
+        std::unique_ptr<ProbabilisticContextFreeGrammar> grammar(new ProbabilisticContextFreeGrammar());
+        if (!grammar->read_image(image)) {
+            grammar.reset();
+        }
+        return grammar;
+    }
+
+    /// Writes the grammar as a GrammarImage, which can be loaded much faster than the text format.
+    bool write_image(const std::string& path) const {
+        GrammarImage::Writer writer;
+
+        std::vector<std::uint64_t> string_offsets(1, 0);
+        std::vector<char> strings;
+        for (unsigned s = 0; s < signature.size(); ++s) {
+            const ExternalSymbol& name = signature.resolve_id(s);
+            strings.insert(strings.end(), name.begin(), name.end());
+            string_offsets.push_back(strings.size());
+        }
+        writer.set(GrammarImage::STRING_OFFSETS, string_offsets);
+        writer.set(GrammarImage::STRINGS, strings);
+
+        std::vector<GrammarImage::RuleRecord> records;
+        std::vector<Symbol> rhs_symbols;
+        std::vector<Probability> probabilities;
+        records.reserve(no_of_rules());
+        probabilities.reserve(no_of_rules());
+        for (const PCFGRule& rule : productions) {
+            records.push_back(GrammarImage::RuleRecord{rule.get_lhs(), rule.arity(), rhs_symbols.size()});
+            rhs_symbols.insert(rhs_symbols.end(), rule.get_rhs().begin(), rule.get_rhs().end());
+            probabilities.push_back(rule.get_prob());
+        }
+        writer.set(GrammarImage::RULES, records);
+        writer.set(GrammarImage::RHS_SYMBOLS, rhs_symbols);
+        writer.set(GrammarImage::PROBABILITIES, probabilities);
+
+        write_rhs_index(writer, first_symbol_rules, GrammarImage::FIRST_OFFSETS, GrammarImage::FIRST_RULES);
+        write_rhs_index(writer, second_symbol_rules, GrammarImage::SECOND_OFFSETS, GrammarImage::SECOND_RULES);
+        write_rhs_index(writer, terminal_rules, GrammarImage::TERMINAL_OFFSETS, GrammarImage::TERMINAL_RULES);
+
+        return writer.write(path, start_symbol);
+    }
+
     /// Returns the id of the start symbol. Use the signature to translate it
     /// into a string.
     const Symbol& get_start_symbol() const {
@@ -93,6 +147,58 @@ public: // Functions
         return nonterminal_symbols.find(sym) == nonterminal_symbols.end();
     }
 
+    /// Returns the number of nonterminals, which is also the upper bound of their dense IDs.
+    unsigned no_of_nonterminals() const {
+        return nonterminal_id_to_symbol.size();
+    }
+
+    /// Returns the dense ID (0 <= ID < no_of_nonterminals()) of a nonterminal or -1 for any other symbol.
+    /// Dense IDs are used to index charts and are only valid until the grammar is cleaned.
+    inline NonterminalID get_nonterminal_id(const Symbol& sym) const {
+        return (sym >= 0 && (unsigned) sym < symbol_to_nonterminal_id.size()) ? symbol_to_nonterminal_id[sym] : -1;
+    }
+
+    /// Returns the symbol for a dense nonterminal ID.
+    inline const Symbol& get_nonterminal_symbol(const NonterminalID& id) const {
+        return nonterminal_id_to_symbol[id];
+    }
+
+    /*
+     * Returns a const vector of const pointers to the preterminal rules (rules with arity 1), that produce the given terminal.
+     * Example: [NN -> house] and [VB -> house] will be returned when this method is called with 'house' as an argument.
+     * This lexicon makes the base case of the inside algorithm independent of the number of rules per preterminal.
+     *
+     * CompiledGrammar has a second, array based lexicon for the chart engine. That one copies the probabilities
+     * and is rebuilt in every iteration. This one points into the rules, so it stays valid while the
+     * probabilities change and serves the recursive InsideOutsideCalculator, which works on the grammar itself.
+     * It is also stored in the GrammarImage, so an image needs no index building for the recursive engine either.
+     */
+    inline const RulePointerVector * get_rules_for_terminal(const Symbol& terminal) const {
+        SymbolToRuleVectorMap::const_iterator cit = terminal_rules.find(terminal);
+        return cit != terminal_rules.end() ? &(cit->second) : nullptr;
+    }
+
+    /// Returns the number of rules in this grammar, which is also the upper bound of the rule IDs.
+    unsigned no_of_rules() const {
+        return productions.size();
+    }
+
+    /// Returns the dense ID (0 <= ID < no_of_rules()) of a rule of this grammar. The ID is the position
+    /// of the rule in the sorted rule vector and stays the same until the grammar is cleaned.
+    inline RuleID get_rule_id(const PCFGRule& rule) const {
+        assert(&rule >= &productions.front() && &rule <= &productions.back());
+        return &rule - &productions.front();
+    }
+
+    /// Returns the rule for a dense rule ID.
+    inline const PCFGRule& get_rule(const RuleID& id) const {
+        return productions[id];
+    }
+
+    inline PCFGRule& get_rule(const RuleID& id) {
+        return productions[id];
+    }
+
     /// Returns a range of rules for a given lhs symbol
     LHSRange rules_for(const Symbol& lhs) const {
         RuleIndex::const_iterator f_lhs = rule_index.find(lhs);
@@ -181,8 +287,8 @@ public: // Functions
      * Removes all rules, that have probability=0
      */
     void clean_grammar() {
-        VLOG(4) << "PCFG: Cleaning - Starting cleaning process...";
-        VLOG(5) << "PCFG: Cleaning - Currently there are " << productions.size() << " rules in this grammar.";
+        PCFGEM_VLOG(4) << "PCFG: Cleaning - Starting cleaning process...";
+        PCFGEM_VLOG(5) << "PCFG: Cleaning - Currently there are " << productions.size() << " rules in this grammar.";
 
         unsigned no_rules_before_clean = productions.size();
 
@@ -224,22 +330,25 @@ public: // Functions
         rule_index.clear();
         first_symbol_rules.clear();
         second_symbol_rules.clear();
+        terminal_rules.clear();
         nonterminal_symbols.clear();
         vocabulary.clear();
+        symbol_to_nonterminal_id.clear();
+        nonterminal_id_to_symbol.clear();
 
         // Rebuild structures if anything was changed.
-        VLOG(5) << "PCFG: Cleaning - Rebuilding the rule index...";
+        PCFGEM_VLOG(5) << "PCFG: Cleaning - Rebuilding the rule index...";
         build_rule_index();
-        VLOG(5) << "PCFG: Cleaning - Finished rebuilding the rule index!";
+        PCFGEM_VLOG(5) << "PCFG: Cleaning - Finished rebuilding the rule index!";
 
-        VLOG(5) << "PCFG: Cleaning - Rebuilding rhs vectors...";
+        PCFGEM_VLOG(5) << "PCFG: Cleaning - Rebuilding rhs vectors...";
         build_rule_rhs_index();
-        VLOG(5) << "PCFG: Cleaning - Finished rebuilding rhs vectors!";
+        PCFGEM_VLOG(5) << "PCFG: Cleaning - Finished rebuilding rhs vectors!";
 
 
         assert(nonterminal_symbols.find(get_start_symbol()) != nonterminal_symbols.end());
 
-        VLOG(4) << "PCFG: Cleaning - Finished cleaning process! " << no_rules_before_clean - productions.size() << " rules have been deleted!";
+        PCFGEM_VLOG(4) << "PCFG: Cleaning - Finished cleaning process! " << no_rules_before_clean - productions.size() << " rules have been deleted!";
 
     }
 
@@ -283,6 +392,10 @@ public: // Functions
     }
 
 private:
+    /// An empty grammar, which is filled by from_image().
+    ProbabilisticContextFreeGrammar() {
+    }
+
     /// Read in the grammar from a stream.
     bool read_in(std::istream& grm_in) {
         std::string line;
@@ -295,7 +408,7 @@ private:
                 /// create a rule
                 if (first_rule) { // this is the first line of the grammar
                     first_rule = false;
-                    VLOG(5) << "PCFG: Setting '" << line << "' as startsymbol.";
+                    PCFGEM_VLOG(5) << "PCFG: Setting '" << line << "' as startsymbol.";
                     set_start_symbol(signature.add_symbol(line));
                     continue;
                 } else {
@@ -325,6 +438,171 @@ private:
     }
 
 
+    /// Read in the grammar from an image. The rules and the rhs indexes are taken in the order of the
+    /// image, so the grammar is the same as the one that was compiled.
+    bool read_image(const GrammarImage& image) {
+        if (!image.is_open() || image.size(GrammarImage::STRING_OFFSETS) == 0
+                || image.size(GrammarImage::PROBABILITIES) != image.size(GrammarImage::RULES)
+                || image.size(GrammarImage::FIRST_OFFSETS) != image.size(GrammarImage::STRING_OFFSETS)
+                || image.size(GrammarImage::SECOND_OFFSETS) != image.size(GrammarImage::STRING_OFFSETS)
+                || image.size(GrammarImage::TERMINAL_OFFSETS) != image.size(GrammarImage::STRING_OFFSETS)) {
+            LOG(ERROR) << "PCFG: The grammar image is incomplete, the grammar stays empty.";
+            return false;
+        }
+        if (!check_image(image)) {
+            LOG(ERROR) << "PCFG: The grammar image is corrupt, the grammar stays empty.";
+            return false;
+        }
+        unsigned no_of_symbols = image.size(GrammarImage::STRING_OFFSETS) - 1;
+        const std::uint64_t * string_offsets = image.section<std::uint64_t>(GrammarImage::STRING_OFFSETS);
+        const char * strings = image.section<char>(GrammarImage::STRINGS);
+        signature.reserve(no_of_symbols);
+        for (unsigned s = 0; s < no_of_symbols; ++s) {
+            signature.add_symbol(ExternalSymbol(strings + string_offsets[s], strings + string_offsets[s + 1]));
+        }
+        set_start_symbol(image.start_symbol());
+
+        const GrammarImage::RuleRecord * records = image.section<GrammarImage::RuleRecord>(GrammarImage::RULES);
+        const Symbol * rhs_symbols = image.section<Symbol>(GrammarImage::RHS_SYMBOLS);
+        const Probability * probabilities = image.section<Probability>(GrammarImage::PROBABILITIES);
+        productions.reserve(image.size(GrammarImage::RULES));
+        for (unsigned r = 0; r < image.size(GrammarImage::RULES); ++r) {
+            const Symbol * rhs = rhs_symbols + records[r].rhs_offset;
+            productions.push_back(PCFGRule(records[r].lhs, PCFGRule::IDVector(rhs, rhs + records[r].arity), probabilities[r], signature));
+        }
+        // The rules are sorted by their lhs, so this is a single pass without any sorting.
+        build_rule_index();
+
+        read_rhs_index(image, first_symbol_rules, GrammarImage::FIRST_OFFSETS, GrammarImage::FIRST_RULES);
+        read_rhs_index(image, second_symbol_rules, GrammarImage::SECOND_OFFSETS, GrammarImage::SECOND_RULES);
+        read_rhs_index(image, terminal_rules, GrammarImage::TERMINAL_OFFSETS, GrammarImage::TERMINAL_RULES);
+        return true;
+    }
+
+    /// Checks that all sections have the expected types and that every offset and ID of the image
+    /// is within its section, before anything is read from it. The problem is logged.
+    bool check_image(const GrammarImage& image) const {
+        const std::uint64_t * string_offsets = image.section<std::uint64_t>(GrammarImage::STRING_OFFSETS);
+        const char * strings = image.section<char>(GrammarImage::STRINGS);
+        const GrammarImage::RuleRecord * records = image.section<GrammarImage::RuleRecord>(GrammarImage::RULES);
+        const Symbol * rhs_symbols = image.section<Symbol>(GrammarImage::RHS_SYMBOLS);
+        if (string_offsets == nullptr || strings == nullptr || records == nullptr || rhs_symbols == nullptr
+                || image.section<Probability>(GrammarImage::PROBABILITIES) == nullptr) {
+            return false;
+        }
+
+        std::uint64_t no_of_symbols = image.size(GrammarImage::STRING_OFFSETS) - 1;
+        if (no_of_symbols > std::uint64_t(std::numeric_limits<Symbol>::max())) {
+            LOG(ERROR) << "PCFG: The grammar image has too many symbols.";
+            return false;
+        }
+        for (std::uint64_t s = 0; s < no_of_symbols; ++s) {
+            if (string_offsets[s] > string_offsets[s + 1] || string_offsets[s + 1] > image.size(GrammarImage::STRINGS)) {
+                LOG(ERROR) << "PCFG: The name of the symbol " << s << " in the grammar image is out of bounds.";
+                return false;
+            }
+        }
+        if (image.start_symbol() < 0 || std::uint64_t(image.start_symbol()) >= no_of_symbols) {
+            LOG(ERROR) << "PCFG: The start symbol of the grammar image is not a symbol.";
+            return false;
+        }
+
+        std::uint64_t no_of_rhs_symbols = image.size(GrammarImage::RHS_SYMBOLS);
+        bool start_has_rules = false;
+        for (std::uint64_t r = 0; r < image.size(GrammarImage::RULES); ++r) {
+            const GrammarImage::RuleRecord& record = records[r];
+            start_has_rules = start_has_rules || record.lhs == image.start_symbol();
+            if (record.lhs < 0 || std::uint64_t(record.lhs) >= no_of_symbols || (r > 0 && record.lhs < records[r - 1].lhs)) {
+                LOG(ERROR) << "PCFG: The lhs of the rule " << r << " in the grammar image is not a symbol or not sorted.";
+                return false;
+            }
+            if (record.rhs_offset > no_of_rhs_symbols || record.arity > no_of_rhs_symbols - record.rhs_offset) {
+                LOG(ERROR) << "PCFG: The rhs of the rule " << r << " in the grammar image is out of bounds.";
+                return false;
+            }
+            for (std::uint64_t i = record.rhs_offset; i < record.rhs_offset + record.arity; ++i) {
+                if (rhs_symbols[i] < 0 || std::uint64_t(rhs_symbols[i]) >= no_of_symbols) {
+                    LOG(ERROR) << "PCFG: The rhs of the rule " << r << " in the grammar image is not a symbol.";
+                    return false;
+                }
+            }
+        }
+
+        if (!start_has_rules) {
+            LOG(ERROR) << "PCFG: The start symbol of the grammar image is not a nonterminal.";
+            return false;
+        }
+
+        return check_rhs_index(image, GrammarImage::FIRST_OFFSETS, GrammarImage::FIRST_RULES, 2, 0)
+                && check_rhs_index(image, GrammarImage::SECOND_OFFSETS, GrammarImage::SECOND_RULES, 2, 1)
+                && check_rhs_index(image, GrammarImage::TERMINAL_OFFSETS, GrammarImage::TERMINAL_RULES, 1, 0);
+    }
+
+    /// The offsets of an rhs index must grow and stay within its rules, which must be rule IDs.
+    /// Every rule listed for the symbol s must have the given arity and s at the given position of
+    /// its rhs, since the calculators rely on that. The rules have been checked by check_image().
+    bool check_rhs_index(const GrammarImage& image, GrammarImage::SectionID offsets_id, GrammarImage::SectionID rules_id,
+            unsigned arity, unsigned position) const {
+        const std::uint32_t * offsets = image.section<std::uint32_t>(offsets_id);
+        const std::uint32_t * rule_ids = image.section<std::uint32_t>(rules_id);
+        const GrammarImage::RuleRecord * records = image.section<GrammarImage::RuleRecord>(GrammarImage::RULES);
+        const Symbol * rhs_symbols = image.section<Symbol>(GrammarImage::RHS_SYMBOLS);
+        if (offsets == nullptr || rule_ids == nullptr) {
+            return false;
+        }
+        for (std::uint64_t s = 0; s + 1 < image.size(offsets_id); ++s) {
+            if (offsets[s] > offsets[s + 1] || offsets[s + 1] > image.size(rules_id)) {
+                LOG(ERROR) << "PCFG: The offsets of an rhs index in the grammar image are out of bounds.";
+                return false;
+            }
+            for (std::uint32_t r = offsets[s]; r < offsets[s + 1]; ++r) {
+                if (rule_ids[r] >= image.size(GrammarImage::RULES)) {
+                    LOG(ERROR) << "PCFG: An rhs index in the grammar image refers to the rule " << rule_ids[r] << ", which does not exist.";
+                    return false;
+                }
+                const GrammarImage::RuleRecord& record = records[rule_ids[r]];
+                if (record.arity != arity || rhs_symbols[record.rhs_offset + position] != Symbol(s)) {
+                    LOG(ERROR) << "PCFG: An rhs index in the grammar image lists the rule " << rule_ids[r] << " for the symbol " << s << ", which it does not fit.";
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// Stores a map from symbols to rules as offsets per symbol ID and the IDs of the rules.
+    void write_rhs_index(GrammarImage::Writer& writer, const SymbolToRuleVectorMap& index,
+            GrammarImage::SectionID offsets_id, GrammarImage::SectionID rules_id) const {
+        std::vector<std::uint32_t> offsets(1, 0);
+        std::vector<std::uint32_t> rule_ids;
+        for (unsigned s = 0; s < signature.size(); ++s) {
+            SymbolToRuleVectorMap::const_iterator cit = index.find(s);
+            if (cit != index.end()) {
+                for (const PCFGRule* rule : cit->second) {
+                    rule_ids.push_back(get_rule_id(*rule));
+                }
+            }
+            offsets.push_back(rule_ids.size());
+        }
+        writer.set(offsets_id, offsets);
+        writer.set(rules_id, rule_ids);
+    }
+
+    void read_rhs_index(const GrammarImage& image, SymbolToRuleVectorMap& index,
+            GrammarImage::SectionID offsets_id, GrammarImage::SectionID rules_id) {
+        const std::uint32_t * offsets = image.section<std::uint32_t>(offsets_id);
+        const std::uint32_t * rule_ids = image.section<std::uint32_t>(rules_id);
+        for (unsigned s = 0; s + 1 < image.size(offsets_id); ++s) {
+            if (offsets[s] != offsets[s + 1]) {
+                RulePointerVector& rules = index[s];
+                rules.reserve(offsets[s + 1] - offsets[s]);
+                for (std::uint32_t r = offsets[s]; r != offsets[s + 1]; ++r) {
+                    rules.push_back(&productions[rule_ids[r]]);
+                }
+            }
+        }
+    }
+
     // Add a rule to the rule-vector
     void add_rule(PCFGRule& r) {
         // save it in the rule vector
@@ -369,6 +647,19 @@ private:
 
 
 
+        }
+        build_nonterminal_ids();
+    }
+
+    /// Assigns a dense ID to each nonterminal, ordered by the symbol IDs of the signature.
+    void build_nonterminal_ids() {
+        nonterminal_id_to_symbol.assign(nonterminal_symbols.begin(), nonterminal_symbols.end());
+        std::sort(nonterminal_id_to_symbol.begin(), nonterminal_id_to_symbol.end());
+
+        Symbol max_symbol = nonterminal_id_to_symbol.empty() ? -1 : nonterminal_id_to_symbol.back();
+        symbol_to_nonterminal_id.assign(max_symbol + 1, -1);
+        for (unsigned i = 0; i < nonterminal_id_to_symbol.size(); ++i) {
+            symbol_to_nonterminal_id[nonterminal_id_to_symbol[i]] = i;
         }
     }
 
@@ -383,6 +674,9 @@ private:
                     // map the first and the second symbol on the rhs to a vector containing a pointer to this rule
                     first_symbol_rules[(*rule)[0]].push_back(&(*rule));
                     second_symbol_rules[(*rule)[1]].push_back(&(*rule));
+                } else if (rule->arity() == 1) {
+                    // map the terminal to all its preterminal rules
+                    terminal_rules[(*rule)[0]].push_back(&(*rule));
                 }
             }
         }
@@ -423,6 +717,10 @@ private:
 
     SymbolToRuleVectorMap first_symbol_rules; ///< Maps a symbol to all rules, where it appeares as the first symbol on the rhs.
     SymbolToRuleVectorMap second_symbol_rules; ///< Maps a symbol to all rules, where it appeares as the second symbol on the rhs.
+    SymbolToRuleVectorMap terminal_rules; ///< Maps a terminal to all preterminal rules, that produce it (the lexicon of the recursive engine, see get_rules_for_terminal()).
+
+    SymbolToNonterminalIDVector symbol_to_nonterminal_id; ///< Maps a symbol ID to its dense nonterminal ID (or -1).
+    SymbolVector nonterminal_id_to_symbol; ///< Maps a dense nonterminal ID back to its symbol ID.
 };
 
 #endif
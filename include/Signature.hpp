@@ -10,7 +10,7 @@
 
 #include <boost/unordered_map.hpp>
 #include <vector>
-#include "easylogging++.h"
+#include "Tracing.hpp"
 
 /// Maps objects to a unique numeric value.
 template <typename EXTERNAL_OBJECT_TYPE>
@@ -31,6 +31,17 @@ public:
     Signature() {
     }
 
+    /// Prepares the signature for the given number of symbols.
+    void reserve(unsigned no_of_symbols) {
+        internal_to_external.reserve(no_of_symbols);
+        external_to_internal.reserve(no_of_symbols);
+    }
+
+    /// Returns the number of symbols, which is also the upper bound of their IDs.
+    unsigned size() const {
+        return number_of_entries();
+    }
+
     /// Returns true, if the given symbol does exist in the signature
     bool containsSymbol(const Symbol &symbol) const {
         return external_to_internal.find(symbol) != external_to_internal.end();
@@ -48,7 +59,7 @@ public:
             return result;
         } else {
             // add symbol to signature
-            VLOG(9) << "Signature: New mapping added: '" << new_symbol << "' <-> " << number_of_entries();
+            PCFGEM_VLOG(9) << "Signature: New mapping added: '" << new_symbol << "' <-> " << number_of_entries();
             external_to_internal[new_symbol] = number_of_entries();
             internal_to_external.push_back(new_symbol);
             return number_of_entries() - 1;
@@ -60,7 +71,8 @@ public:
      * Use add_symbol() as often as possible, if a non const method is ok.
      */
     ID resolve_symbol(const Symbol & symbol) const {
-        return containsSymbol(symbol) ? external_to_internal.find(symbol)->second : -1; // return -1, if the symbol does not exist in the signature.
+        typename SymbolToIDMap::const_iterator entry = external_to_internal.find(symbol);
+        return entry != external_to_internal.end() ? entry->second : -1; // return -1, if the symbol does not exist in the signature.
     }
 
     /// Returns the symbol for a given ID or an empty symbol
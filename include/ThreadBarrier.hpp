@@ -0,0 +1,43 @@
+/*
+ * File:   ThreadBarrier.hpp
+ * Author: Johannes Gontrum
+ *
+ * Reusable barrier for a fixed number of threads.
+ */
+
+#ifndef THREADBARRIER_HPP
+#define	THREADBARRIER_HPP
+
+#include <mutex>
+#include <condition_variable>
+
+/// Blocks the threads that call wait(), until all of them have arrived. Can be used again right away.
+class ThreadBarrier {
+public:
+    explicit ThreadBarrier(unsigned threads) : no_of_threads(threads), waiting(0), generation(0) {
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned arrived_in = generation;
+        if (++waiting == no_of_threads) {
+            // The last thread releases all others and starts the next generation.
+            waiting = 0;
+            ++generation;
+            condition.notify_all();
+        } else {
+            condition.wait(lock, [this, arrived_in]() {
+                return generation != arrived_in;
+            });
+        }
+    }
+
+private:
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    unsigned                    no_of_threads;  ///< Number of threads that have to arrive
+    unsigned                    waiting;        ///< Number of threads that have arrived in this generation
+    unsigned                    generation;     ///< Number of times the barrier was released
+};
+
+#endif	/* THREADBARRIER_HPP */
@@ -0,0 +1,36 @@
+/*
+ * File:   Tracing.hpp
+ * Author: Johannes Gontrum
+ *
+ * Verbose logging with a verbose level ceiling that is fixed at compile time.
+ */
+
+#ifndef TRACING_HPP
+#define	TRACING_HPP
+
+#include "easylogging++.h"
+
+/*
+ * The messages of the higher verbose levels are written from the innermost loops of the
+ * calculators, e.g. several times for every (symbol, begin, end) triple of the recursive
+ * engine. Even when the level is not enabled at runtime, easylogging++ has to check it for
+ * each of them. Therefore, all verbose messages are written with PCFGEM_VLOG, which is the
+ * VLOG of easylogging++ for the levels up to PCFGEM_MAX_VLEVEL. For the higher levels, the
+ * message is in a branch that is never taken because of a constant condition, so the compiler
+ * removes it together with its arguments (and calls like Signature::resolve_id).
+ *
+ * The normal build keeps the levels up to 5, which are written at most once per sentence.
+ * The debug build (make debug, or -DPCFGEM_DEBUG) keeps all levels. Any other ceiling can be
+ * chosen with -DPCFGEM_MAX_VLEVEL=x.
+ */
+#ifndef PCFGEM_MAX_VLEVEL
+#ifdef PCFGEM_DEBUG
+#define PCFGEM_MAX_VLEVEL 10
+#else
+#define PCFGEM_MAX_VLEVEL 5
+#endif
+#endif
+
+#define PCFGEM_VLOG(level) if ((level) > PCFGEM_MAX_VLEVEL) {} else VLOG(level)
+
+#endif	/* TRACING_HPP */
@@ -0,0 +1,156 @@
+/*
+ * File:   WorkStealingPool.hpp
+ * Author: Johannes Gontrum
+ *
+ * Runs a fixed set of tasks on several threads, idle threads steal from busy ones.
+ */
+
+#ifndef WORKSTEALINGPOOL_HPP
+#define	WORKSTEALINGPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+/*
+ * Every worker has its own queue of task IDs. Task i is initially given to worker
+ * i % threads, so if the tasks are sorted by decreasing costs, every worker starts with
+ * one of the most expensive tasks. A worker takes its tasks from the front of its own queue.
+ * When the queue is empty, it steals one task from the back of the queue of another worker,
+ * which is the cheapest remaining task there. The pool returns when all tasks are done.
+ *
+ * For each run, the time every worker spent in tasks is recorded, so the utilisation of
+ * the threads can be reported.
+ */
+class WorkStealingPool {
+public:
+    typedef std::chrono::steady_clock       Clock;
+
+    /// Statistics of the last run.
+    struct Statistics {
+        double                  wall_seconds;   ///< Time from the start of the first to the end of the last task
+        std::vector<double>     busy_seconds;   ///< Time per worker spent in tasks
+        std::vector<unsigned>   tasks;          ///< Number of tasks per worker
+        std::vector<unsigned>   steals;         ///< Number of tasks per worker that were stolen from another worker
+
+        /// The busy time of all workers divided by the time that they were available.
+        double utilisation() const {
+            double busy = 0;
+            for (double seconds : busy_seconds) {
+                busy += seconds;
+            }
+            return wall_seconds > 0 ? busy / (wall_seconds * busy_seconds.size()) : 1;
+        }
+
+        double min_busy_seconds() const {
+            return busy_seconds.empty() ? 0 : *std::min_element(busy_seconds.begin(), busy_seconds.end());
+        }
+
+        double max_busy_seconds() const {
+            return busy_seconds.empty() ? 0 : *std::max_element(busy_seconds.begin(), busy_seconds.end());
+        }
+
+        unsigned total_steals() const {
+            unsigned sum = 0;
+            for (unsigned s : steals) {
+                sum += s;
+            }
+            return sum;
+        }
+    };
+
+private:
+    struct TaskQueue {
+        std::mutex              mutex;
+        std::deque<unsigned>    tasks;
+    };
+
+public:
+    explicit WorkStealingPool(unsigned threads) : no_of_threads(std::max(1u, threads)) {
+    }
+
+    unsigned get_no_of_threads() const {
+        return no_of_threads;
+    }
+
+    /// Calls function(task, worker) for every task 0 <= task < no_of_tasks and returns when all of them are done.
+    /// The function is called from different threads at the same time, but never twice for the same task.
+    template <typename Function>
+    void run(unsigned no_of_tasks, Function function) {
+        std::vector<TaskQueue> queues(no_of_threads);
+        for (unsigned task = 0; task < no_of_tasks; ++task) {
+            queues[task % no_of_threads].tasks.push_back(task);
+        }
+
+        statistics.busy_seconds.assign(no_of_threads, 0);
+        statistics.tasks.assign(no_of_threads, 0);
+        statistics.steals.assign(no_of_threads, 0);
+
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> workers;
+        for (unsigned w = 0; w < no_of_threads; ++w) {
+            workers.push_back(std::thread([this, &queues, &function, w]() {
+                work(queues, function, w);
+            }));
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        statistics.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    const Statistics& get_statistics() const {
+        return statistics;
+    }
+
+private:
+    template <typename Function>
+    void work(std::vector<TaskQueue>& queues, Function& function, unsigned worker) {
+        unsigned task;
+        bool stolen;
+        while (next_task(queues, worker, task, stolen)) {
+            Clock::time_point start = Clock::now();
+            function(task, worker);
+            // Each worker only writes its own entries.
+            statistics.busy_seconds[worker] += std::chrono::duration<double>(Clock::now() - start).count();
+            ++statistics.tasks[worker];
+            if (stolen) {
+                ++statistics.steals[worker];
+            }
+        }
+    }
+
+    /// Takes the next task from the own queue or steals one. Returns false, if all queues are empty.
+    bool next_task(std::vector<TaskQueue>& queues, unsigned worker, unsigned& task, bool& stolen) {
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            if (!queues[worker].tasks.empty()) {
+                task = queues[worker].tasks.front();
+                queues[worker].tasks.pop_front();
+                stolen = false;
+                return true;
+            }
+        }
+        // Tasks are never added during a run, so once every queue was seen empty, the work is done.
+        for (unsigned offset = 1; offset < no_of_threads; ++offset) {
+            TaskQueue& victim = queues[(worker + offset) % no_of_threads];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                stolen = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    unsigned        no_of_threads;  ///< Number of workers
+    Statistics      statistics;     ///< Statistics of the last run
+};
+
+#endif	/* WORKSTEALINGPOOL_HPP */
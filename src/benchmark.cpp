@@ -0,0 +1,192 @@
+/*
+ * File:   benchmark.cpp
+ * Author: Johannes Gontrum
+ *
+ * Measures the throughput of the ChartInsideOutsideCalculator for every
+ * instruction set of the InsideOutsideKernel that this CPU supports, with plain
+ * and with scaled arithmetic, and the recursive InsideOutsideCalculator with
+ * every storage policy of the InsideOutsideCache.
+ */
+#define _ELPP_DISABLE_LOGS
+#define NDEBUG
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+
+#include <boost/tokenizer.hpp>
+
+#include "../include/ProbabilisticContextFreeGrammar.hpp"
+#include "../include/CompiledGrammar.hpp"
+#include "../include/ChartInsideOutsideCalculator.hpp"
+#include "../include/InsideOutsideKernel.hpp"
+#include "../include/InsideOutsideCalculator.hpp"
+#include "../include/InsideOutsideStorage.hpp"
+#include "../include/ExpectedCounts.hpp"
+
+#include "../include/easylogging++.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+typedef ProbabilisticContextFreeGrammar::Symbol Symbol;
+typedef std::vector<Symbol> SymbolVector;
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * Runs the work of the recursive engine for every sentence: the inside value of the whole
+ * sentence and, if it can be parsed, the inside and outside values of every nonterminal for
+ * every span. Returns the seconds and the memory of the largest cache in bytes.
+ */
+template <typename Storage>
+double benchmark_cache(ProbabilisticContextFreeGrammar& grammar, const std::vector<SymbolVector>& sentences,
+        unsigned repetitions, std::size_t& max_memory, double& checksum) {
+    typedef InsideOutsideCalculator<Storage> Calculator;
+    max_memory = 0;
+    checksum = 0;
+    Clock::time_point start = Clock::now();
+    for (unsigned r = 0; r < repetitions; ++r) {
+        for (const SymbolVector& sentence : sentences) {
+            InsideOutsideCache<Storage> cache(grammar, sentence.size());
+            Calculator iocalc(cache, &sentence);
+            typename Calculator::LengthType last = sentence.size() - 1;
+            double inside_sentence = iocalc.calculate_inside(grammar.get_start_symbol(), 0, last);
+            if (inside_sentence > 0) {
+                for (unsigned nt = 0; nt < grammar.no_of_nonterminals(); ++nt) {
+                    Symbol symbol = grammar.get_nonterminal_symbol(nt);
+                    for (unsigned begin = 0; begin <= last; ++begin) {
+                        for (unsigned end = begin; end <= last; ++end) {
+                            checksum += iocalc.calculate_outside(symbol, begin, end) * iocalc.calculate_inside(symbol, begin, end) / inside_sentence;
+                        }
+                    }
+                }
+            }
+            max_memory = std::max(max_memory, cache.memory_usage());
+        }
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename Storage>
+void report_cache(ProbabilisticContextFreeGrammar& grammar, const std::vector<SymbolVector>& sentences,
+        unsigned repetitions, double& node_seconds) {
+    std::size_t max_memory;
+    double checksum;
+    double seconds = benchmark_cache<Storage>(grammar, sentences, repetitions, max_memory, checksum);
+    if (node_seconds == 0) {
+        node_seconds = seconds;
+    }
+    std::cout << Storage::name() << "\t" << seconds << " s\t" << node_seconds / seconds << "x node\t"
+            << max_memory / 1024 << " KiB largest cache\tchecksum " << checksum << "\n";
+}
+
+int main(int argc, const char * argv[])
+{
+    typedef boost::char_separator<char> CharSeparator;
+    typedef boost::tokenizer<CharSeparator> Tokenizer;
+
+    if (argc < 3) {
+        std::cerr << "Usage: pcfgem-benchmark GRAMMAR CORPUS [REPETITIONS] [kernels|caches|all]\n";
+        return 1;
+    }
+    unsigned repetitions = argc > 3 ? std::atoi(argv[3]) : 5;
+    std::string part = argc > 4 ? argv[4] : "kernels";
+    if (part != "kernels" && part != "caches" && part != "all") {
+        std::cerr << "Unknown part: '" << part << "'\n";
+        return 1;
+    }
+
+    std::ifstream grammar_file(argv[1]);
+    std::ifstream corpus_file(argv[2]);
+    if (!grammar_file || !corpus_file) {
+        std::cerr << "Could not read '" << argv[1] << "' or '" << argv[2] << "'\n";
+        return 1;
+    }
+
+    ProbabilisticContextFreeGrammar grammar(grammar_file);
+    CompiledGrammar compiled(grammar);
+
+    // Read in all sentences that can be resolved with the signature of the grammar.
+    std::vector<SymbolVector> sentences;
+    std::string line;
+    while (std::getline(corpus_file, line)) {
+        SymbolVector sentence;
+        bool valid = true;
+        Tokenizer tokens(line, CharSeparator("\t "));
+        for (const std::string& word : tokens) {
+            Symbol id = grammar.get_signature().resolve_symbol(word);
+            valid = valid && id >= 0;
+            sentence.push_back(id);
+        }
+        if (valid && !sentence.empty()) {
+            sentences.push_back(sentence);
+        }
+    }
+
+    if (part != "kernels") {
+        // The recursive engine, with every storage of its cache.
+        std::cout << sentences.size() << " sentences, " << grammar.no_of_nonterminals() << " nonterminals, "
+                << repetitions << " runs of the recursive engine\n";
+        double node_seconds = 0;
+        report_cache<NodeMapStorage>(grammar, sentences, repetitions, node_seconds);
+        report_cache<FlatMapStorage>(grammar, sentences, repetitions, node_seconds);
+        report_cache<DenseTriangularStorage>(grammar, sentences, repetitions, node_seconds);
+        report_cache<SparseCellStorage>(grammar, sentences, repetitions, node_seconds);
+        if (part == "caches") {
+            return 0;
+        }
+    }
+
+    // A rule application is one binary rule at one split point of one span in one pass.
+    // The inside pass tries all of them, the outside pass only runs for parsed sentences.
+    double rules = compiled.get_binary_rules().size();
+    double applications = 0;
+    {
+        ExpectedCounts counts(grammar.no_of_rules(), grammar.no_of_nonterminals());
+        for (const SymbolVector& sentence : sentences) {
+            double n = sentence.size();
+            ChartInsideOutsideCalculator iocalc(compiled, &sentence, &counts);
+            bool parsed = !std::isinf(iocalc.calculate_log_inside(grammar.get_start_symbol(), 0, sentence.size() - 1));
+            applications += (parsed ? 2 : 1) * rules * (n * n * n - n) / 6;
+        }
+    }
+
+    std::cout << sentences.size() << " sentences, " << rules << " binary rules, "
+            << applications << " rule applications per run, " << repetitions << " runs\n";
+
+    double scalar_rate = 0;
+    for (int set = InsideOutsideKernel::SCALAR; set <= InsideOutsideKernel::AVX512; ++set) {
+        InsideOutsideKernel::InstructionSet instruction_set = InsideOutsideKernel::InstructionSet(set);
+        if (!InsideOutsideKernel::is_supported(instruction_set)) {
+            std::cout << InsideOutsideKernel::name(instruction_set) << "\tnot supported\n";
+            continue;
+        }
+
+        // Plain doubles first, then the scaled arithmetic that does not underflow.
+        for (int mode = ChartInsideOutsideCalculator::PLAIN; mode <= ChartInsideOutsideCalculator::SCALED; ++mode) {
+            ChartInsideOutsideCalculator::Arithmetic arithmetic = ChartInsideOutsideCalculator::Arithmetic(mode);
+            InsideOutsideKernel kernel(instruction_set);
+            ExpectedCounts counts(grammar.no_of_rules(), grammar.no_of_nonterminals());
+            Clock::time_point start = Clock::now();
+            for (unsigned r = 0; r < repetitions; ++r) {
+                for (const SymbolVector& sentence : sentences) {
+                    ChartInsideOutsideCalculator iocalc(compiled, &sentence, &counts, kernel, arithmetic);
+                }
+            }
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            double rate = applications * repetitions / seconds;
+            if (set == InsideOutsideKernel::SCALAR && arithmetic == ChartInsideOutsideCalculator::PLAIN) {
+                scalar_rate = rate;
+            }
+
+            std::cout << InsideOutsideKernel::name(instruction_set) << "\t"
+                    << (arithmetic == ChartInsideOutsideCalculator::PLAIN ? "plain" : "scaled") << "\t" << seconds << " s\t"
+                    << rate << " rule applications/s\t" << rate / scalar_rate << "x scalar\n";
+        }
+    }
+
+    return 0;
+}
@@ -5,13 +5,19 @@
 //  Created by Johannes Gontrum on 26/08/14.
 //
 // #define _ELPP_DISABLE_LOGS
+#define _ELPP_THREAD_SAFE
+// The debug build (make debug) keeps the assertions and all verbose levels, see Tracing.hpp.
+#ifndef PCFGEM_DEBUG
 #define NDEBUG
+#endif
 
 #include <iostream>
 #include <string>
 
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <cstdio>
 
 #include <boost/unordered_set.hpp>
 #include <boost/program_options.hpp>
@@ -23,6 +29,10 @@
 #include "../include/InsideOutsideCalculator.hpp"
 #include "../include/InsideOutsideCache.hpp"
 #include "../include/EMTrainer.hpp"
+#include "../include/GrammarImage.hpp"
+#include "../include/EncodedCorpus.hpp"
+#include "../include/GzipInputStream.hpp"
+#include "../include/ParallelCorpusLoader.hpp"
 
 #include "../include/easylogging++.h"
 
@@ -36,18 +46,76 @@ int main(int argc, const char * argv[])
     typedef boost::tokenizer<CharSeparator> Tokenizer;
     typedef std::vector<std::string> StringVector;
     
+    // 'pcfgem compile GRAMMAR IMAGE' writes a grammar as a binary image, which can be given to --grammar instead.
+    if (argc >= 2 && std::string(argv[1]) == "compile") {
+        if (argc != 4) {
+            std::cerr << "Usage: " << argv[0] << " compile GRAMMAR IMAGE\n";
+            return 1;
+        }
+        std::unique_ptr<std::istream> grammar_file = GzipInputStream::open(argv[2]);
+        if (!*grammar_file) {
+            std::cerr << "Could not read PCFG: '" << argv[2] << "'";
+            return 1;
+        }
+        ProbabilisticContextFreeGrammar grammar(*grammar_file);
+        if (grammar_file->bad()) {
+            std::cerr << "Could not read PCFG: '" << argv[2] << "'";
+            return 1;
+        }
+        if (!grammar.write_image(argv[3])) {
+            std::cerr << "Could not write to file: '" << argv[3] << "'";
+            return 1;
+        }
+        return 0;
+    }
+
+    // 'pcfgem encode-corpus CORPUS FILE' writes a tokenized corpus, which can be given to --corpus instead.
+    if (argc >= 2 && std::string(argv[1]) == "encode-corpus") {
+        if (argc != 4) {
+            std::cerr << "Usage: " << argv[0] << " encode-corpus CORPUS FILE\n";
+            return 1;
+        }
+        std::unique_ptr<std::istream> training_file = GzipInputStream::open(argv[2]);
+        if (!*training_file) {
+            std::cerr << "Could not read training data: '" << argv[2] << "'";
+            return 1;
+        }
+        if (!EncodedCorpus::encode(*training_file, argv[3])) {
+            std::cerr << "Could not write to file: '" << argv[3] << "'";
+            return 1;
+        }
+        if (training_file->bad()) {
+            std::remove(argv[3]);
+            std::cerr << "Could not read training data: '" << argv[2] << "'";
+            return 1;
+        }
+        return 0;
+    }
+
     
     // Define and parse the program options (-> http://www.radmangames.com/programming/how-to-use-boost-program_options)
     namespace po = boost::program_options;
     po::options_description desc("PCFG EMTraining Options");
     desc.add_options()
             ("help", "Print help messages")
-            ("grammar,g", po::value<std::string>(), "Path to a PCFG.")
-            ("corpus,c", po::value<std::string>(), "Path to the training set with sentences seperated by newlines.")
+            ("grammar,g", po::value<std::string>(), "Path to a PCFG (may be gzipped) or to a grammar image from 'pcfgem compile GRAMMAR IMAGE'.")
+            ("corpus,c", po::value<std::string>(), "Path to the training set with sentences seperated by newlines (may be gzipped) or to a file from 'pcfgem encode-corpus CORPUS FILE'.")
             ("save,s", po::value<std::string>(), "Path to save the altered grammar")
             ("out,o", "Output the grammar after the training.")
             ("iterations,i", po::value<unsigned>(), "Amount of training circles to perform. (Default: 3)")
             ("threshold,t", po::value<double>(), "The changes after the final iteration must be less equal to this value. Do not combine with  -i.")
+            ("threads", po::value<unsigned>(), "Number of threads for the estimation step. (Default: 1)")
+            ("chart-threads", po::value<unsigned>(), "Number of threads that fill the chart of one sentence together. (Default: 1)")
+            ("engine", po::value<std::string>(), "Engine for the inside-outside calculation: 'chart' (Default) or 'recursive'.")
+            ("cache", po::value<std::string>(), "Storage of the cache of the recursive engine: 'auto' (Default), 'node', 'flat', 'dense' or 'sparse'.")
+            ("forests", po::value<std::string>(), "Cache the parse forests of the sentences after the first iteration: 'on' (Default) or 'off'.")
+            ("forest-store", po::value<std::string>(), "Keep the parse forests in this file instead of the memory.")
+            ("forest-budget", po::value<unsigned>(), "Memory for the parse forests from --forest-store in MiB. (Default: 512)")
+            ("load-threads", po::value<unsigned>(), "Number of threads that tokenize a text corpus while it is read in. (Default: all cores)")
+            ("stream", po::value<unsigned>(), "Read the corpus from the disk in every iteration, in blocks of this many MiB, instead of keeping it in memory.")
+            ("span-cache", po::value<unsigned>(), "Share the inside values of equal word sequences between sentences, using this many MiB. (Default: 0, off)")
+            ("simd", po::value<std::string>(), "Instruction set for the chart engine: 'scalar', 'sse2', 'avx2' or 'avx512'. (Default: best supported)")
+            ("arithmetic", po::value<std::string>(), "Number representation of the chart engine: 'scaled' (Default) or 'plain'.")
             ("vlevel,v=", po::value<std::string>(), "Define the verbose level (0-10). E.g.: --v=2");
             ;
 
@@ -73,11 +141,147 @@ int main(int argc, const char * argv[])
                 training_file.open(training_arg, std::ios::in);
 
                 if (training_file) {
-                    // Read in grammar
-                    ProbabilisticContextFreeGrammar grammar(grammar_file);
+                    // Read in grammar, either the text format (plain or gzipped) or a compiled image
+                    std::unique_ptr<ProbabilisticContextFreeGrammar> grammar_ptr;
+                    if (GrammarImage::is_image(grammar_arg)) {
+                        GrammarImage image(grammar_arg);
+                        if (!image.is_open()) {
+                            std::cerr << "Could not read grammar image: '" << grammar_arg << "'";
+                            return 1;
+                        }
+                        grammar_ptr = ProbabilisticContextFreeGrammar::from_image(image);
+                        if (!grammar_ptr) {
+                            std::cerr << "Could not read grammar image: '" << grammar_arg << "'";
+                            return 1;
+                        }
+                    } else if (GzipInputStream::is_gzip(grammar_arg)) {
+                        GzipInputStream grammar_gzip(grammar_arg);
+                        grammar_ptr.reset(new ProbabilisticContextFreeGrammar(grammar_gzip));
+                        if (grammar_gzip.bad()) {
+                            std::cerr << "Could not read PCFG: '" << grammar_arg << "'";
+                            return 1;
+                        }
+                    } else {
+                        grammar_ptr.reset(new ProbabilisticContextFreeGrammar(grammar_file));
+                    }
+                    ProbabilisticContextFreeGrammar& grammar = *grammar_ptr;
                                         
-                    // Initialize the EMTrainer
-                    EMTrainer trainer(grammar, training_file);
+                    // Initialize the EMTrainer, either with the text corpus (plain or gzipped) or an encoded one
+                    std::unique_ptr<CorpusStream> stream;
+                    std::unique_ptr<EMTrainer> trainer_ptr;
+                    if (vm.count("stream")) {
+                        std::size_t block_size = std::size_t(std::max(1u, vm["stream"].as<unsigned>())) << 20;
+                        stream.reset(new CorpusStream(training_arg, grammar.get_signature(), block_size));
+                        if (!stream->is_open()) {
+                            std::cerr << "Could not read training data: '" << training_arg << "'";
+                            return 1;
+                        }
+                        trainer_ptr.reset(new EMTrainer(grammar, *stream));
+                    } else if (EncodedCorpus::is_encoded(training_arg)) {
+                        EncodedCorpus encoded(training_arg);
+                        if (!encoded.is_open()) {
+                            std::cerr << "Could not read encoded corpus: '" << training_arg << "'";
+                            return 1;
+                        }
+                        trainer_ptr.reset(new EMTrainer(grammar, encoded));
+                    } else if (GzipInputStream::is_gzip(training_arg)) {
+                        GzipInputStream training_gzip(training_arg);
+                        trainer_ptr.reset(new EMTrainer(grammar, training_gzip));
+                        if (training_gzip.bad()) {
+                            std::cerr << "Could not read training data: '" << training_arg << "'";
+                            return 1;
+                        }
+                    } else if (ParallelCorpusLoader::is_mappable(training_arg)) {
+                        unsigned load_threads = vm.count("load-threads") ? vm["load-threads"].as<unsigned>() : std::thread::hardware_concurrency();
+                        ParallelCorpusLoader loader(training_arg, load_threads);
+                        if (!loader.is_open()) {
+                            std::cerr << "Could not read training data: '" << training_arg << "'";
+                            return 1;
+                        }
+                        trainer_ptr.reset(new EMTrainer(grammar, loader));
+                    } else {
+                        trainer_ptr.reset(new EMTrainer(grammar, training_file));
+                    }
+                    EMTrainer& trainer = *trainer_ptr;
+
+                    if (vm.count("threads")) {
+                        trainer.set_threads(vm["threads"].as<unsigned>());
+                    }
+
+                    if (vm.count("chart-threads")) {
+                        trainer.set_chart_threads(vm["chart-threads"].as<unsigned>());
+                    }
+
+                    if (vm.count("engine")) {
+                        std::string engine_arg = vm["engine"].as<std::string>();
+                        if (engine_arg == "recursive") {
+                            trainer.set_engine(EMTrainer::RECURSIVE);
+                        } else if (engine_arg != "chart") {
+                            std::cerr << "Unknown engine: '" << engine_arg << "'\n";
+                            return 1;
+                        }
+                    }
+
+                    if (vm.count("cache")) {
+                        std::string cache_arg = vm["cache"].as<std::string>();
+                        if (cache_arg == "node") {
+                            trainer.set_cache_storage(EMTrainer::NODE_MAP);
+                        } else if (cache_arg == "flat") {
+                            trainer.set_cache_storage(EMTrainer::FLAT_MAP);
+                        } else if (cache_arg == "dense") {
+                            trainer.set_cache_storage(EMTrainer::DENSE_TRIANGULAR);
+                        } else if (cache_arg == "sparse") {
+                            trainer.set_cache_storage(EMTrainer::SPARSE_CELLS);
+                        } else if (cache_arg != "auto") {
+                            std::cerr << "Unknown cache storage: '" << cache_arg << "'\n";
+                            return 1;
+                        }
+                    }
+
+                    if (vm.count("simd")) {
+                        std::string simd_arg = vm["simd"].as<std::string>();
+                        if (simd_arg == "scalar") {
+                            trainer.set_instruction_set(InsideOutsideKernel::SCALAR);
+                        } else if (simd_arg == "sse2") {
+                            trainer.set_instruction_set(InsideOutsideKernel::SSE2);
+                        } else if (simd_arg == "avx2") {
+                            trainer.set_instruction_set(InsideOutsideKernel::AVX2);
+                        } else if (simd_arg == "avx512") {
+                            trainer.set_instruction_set(InsideOutsideKernel::AVX512);
+                        } else {
+                            std::cerr << "Unknown instruction set: '" << simd_arg << "'\n";
+                            return 1;
+                        }
+                    }
+
+                    if (vm.count("forests")) {
+                        std::string forests_arg = vm["forests"].as<std::string>();
+                        if (forests_arg == "off") {
+                            trainer.set_cache_forests(false);
+                        } else if (forests_arg != "on") {
+                            std::cerr << "Unknown value for --forests: '" << forests_arg << "'\n";
+                            return 1;
+                        }
+                    }
+
+                    if (vm.count("forest-store")) {
+                        std::size_t budget = vm.count("forest-budget") ? vm["forest-budget"].as<unsigned>() : 512;
+                        trainer.set_forest_store(vm["forest-store"].as<std::string>(), budget << 20);
+                    }
+
+                    if (vm.count("span-cache")) {
+                        trainer.set_span_cache(std::size_t(vm["span-cache"].as<unsigned>()) << 20);
+                    }
+
+                    if (vm.count("arithmetic")) {
+                        std::string arithmetic_arg = vm["arithmetic"].as<std::string>();
+                        if (arithmetic_arg == "plain") {
+                            trainer.set_arithmetic(ChartInsideOutsideCalculator::PLAIN);
+                        } else if (arithmetic_arg != "scaled") {
+                            std::cerr << "Unknown arithmetic: '" << arithmetic_arg << "'\n";
+                            return 1;
+                        }
+                    }
                     
                     // Perform the actual training
                     if (vm.count("iterations")) {
@@ -87,6 +291,10 @@ int main(int argc, const char * argv[])
                     } else {
                         trainer.train(unsigned(3)); // default
                     }
+                    if (stream && stream->has_failed()) {
+                        std::cerr << "Could not read training data: '" << training_arg << "'";
+                        return 1;
+                    }
 
                     // If wanted, print the new grammar to cout
                     if (vm.count("out")) { 